@@ -0,0 +1,471 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <sys/param.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include "dns_engine.h"
+
+#ifdef ESP_PLATFORM
+#include "esp_log.h"
+#else
+#define ESP_LOGD(tag, ...) do { (void)(tag); } while (0)
+#endif
+
+static const char *TAG = "DNS_SERVER";
+
+/*
+    Names are hashed right to left (FNV-1a over the lower-cased characters),
+    so the hash of every suffix falls out of a single pass over the queried name
+*/
+#define RULE_HASH_INIT (2166136261u)
+#define RULE_HASH_WILDCARD (0x9e3779b9u)
+
+static inline uint32_t rule_hash_step(uint32_t hash, char c)
+{
+    return (hash ^ (uint8_t)tolower((unsigned char)c)) * 16777619u;
+}
+
+static inline uint32_t rule_hash_final(uint32_t hash, bool wildcard)
+{
+    hash ^= wildcard ? RULE_HASH_WILDCARD : 0;
+    // 0 is reserved for empty slots
+    return hash ? hash : 1;
+}
+
+static uint32_t rule_hash(const char *name, size_t len, bool wildcard)
+{
+    uint32_t hash = RULE_HASH_INIT;
+    while (len > 0) {
+        hash = rule_hash_step(hash, name[--len]);
+    }
+    return rule_hash_final(hash, wildcard);
+}
+
+size_t dns_engine_index_slots(int num_rules)
+{
+    // Keep the index at most half full, so probe sequences stay short
+    size_t slots = 2;
+    while (slots < 2 * (size_t)num_rules) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+// Compiles the rules into the hash index, exact and "*.suffix" names are indexed, "*" is kept aside
+static void rule_index_build(dns_engine_t *e)
+{
+    e->catch_all = -1;
+    for (int i = 0; i < e->num_rules; ++i) {
+        const char *name = e->rules[i].name;
+        bool wildcard = false;
+
+        if (strcmp(name, "*") == 0) {
+            if (e->catch_all < 0) {
+                e->catch_all = i;
+            }
+            continue;
+        }
+        if (strncmp(name, "*.", 2) == 0) {
+            name += 2;
+            wildcard = true;
+        }
+
+        uint32_t hash = rule_hash(name, strlen(name), wildcard);
+        uint32_t slot = hash & e->index_mask;
+        while (e->index[slot].entry != 0) {
+            // Keep the first of duplicated rules, like the former linear scan did
+            if (e->index[slot].hash == hash && e->index[slot].wildcard == wildcard) {
+                const char *other = e->rules[e->index[slot].entry - 1].name + (wildcard ? 2 : 0);
+                if (strcasecmp(other, name) == 0) {
+                    break;
+                }
+            }
+            slot = (slot + 1) & e->index_mask;
+        }
+        if (e->index[slot].entry == 0) {
+            e->index[slot] = (dns_rule_slot_t) {
+                .hash = hash, .entry = i + 1, .wildcard = wildcard
+            };
+        }
+    }
+}
+
+void dns_engine_init(dns_engine_t *engine, dns_engine_rule_t *rules, int num_rules, dns_rule_slot_t *index)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->rules = rules;
+    engine->num_rules = num_rules;
+    engine->index = index;
+    engine->index_mask = dns_engine_index_slots(num_rules) - 1;
+    rule_index_build(engine);
+
+    engine->answer_template.type = htons(QD_TYPE_A);
+    engine->answer_template.ttl = htonl(ANS_TTL_SEC);
+    engine->answer_template.addr_len = htons(sizeof(uint32_t));
+    engine->answer_template.class = htons(QD_CLASS_IN);
+    engine->answer6_template.type = htons(QD_TYPE_AAAA);
+    engine->answer6_template.class = htons(QD_CLASS_IN);
+    engine->answer6_template.ttl = htonl(ANS_TTL_SEC);
+    engine->answer6_template.addr_len = htons(sizeof(engine->answer6_template.ip6_addr));
+    engine->opt_template.type = htons(QD_TYPE_OPT);
+    engine->opt_template.udp_payload_size = htons(DNS_EDNS_MAX_LEN);
+}
+
+static int rule_index_find(const dns_engine_t *e, uint32_t hash, bool wildcard, const char *name)
+{
+    uint32_t slot = hash & e->index_mask;
+    while (e->index[slot].entry != 0) {
+        const dns_rule_slot_t *s = &e->index[slot];
+        if (s->hash == hash && s->wildcard == wildcard &&
+                strcasecmp(e->rules[s->entry - 1].name + (wildcard ? 2 : 0), name) == 0) {
+            return s->entry - 1;
+        }
+        slot = (slot + 1) & e->index_mask;
+    }
+    return -1;
+}
+
+int dns_engine_lookup(const dns_engine_t *engine, const char *name)
+{
+    size_t len = strlen(name);
+    uint32_t hash = RULE_HASH_INIT;
+    int best = engine->catch_all;
+
+    for (size_t i = len; i > 0; --i) {
+        hash = rule_hash_step(hash, name[i - 1]);
+        // name + i - 1 is a whole suffix when it starts a label
+        if (i > 1 && name[i - 2] == '.') {
+            int found = rule_index_find(engine, rule_hash_final(hash, true), true, name + i - 1);
+            if (found >= 0) {
+                best = found;
+            }
+        }
+    }
+    int exact = rule_index_find(engine, rule_hash_final(hash, false), false, name);
+    return exact >= 0 ? exact : best;
+}
+
+/*
+    Keeps the most queried names with the space-saving algorithm: a name not in the table replaces the least
+    counted one and inherits its count, so heavy hitters stick while the table stays fixed-size
+*/
+static void stats_count_name(dns_engine_stats_t *stats, const char *name)
+{
+    size_t len = strnlen(name, DNS_ENGINE_TOP_NAME_LEN - 1);
+    uint32_t hash = rule_hash(name, len, false);
+    int min = 0;
+
+    for (int i = 0; i < DNS_ENGINE_TOP_NAMES; i++) {
+        dns_engine_name_stat_t *n = &stats->top_names[i];
+        if (stats->top_name_hash[i] == hash && strncasecmp(n->name, name, len) == 0 && n->name[len] == '\0') {
+            n->count++;
+            return;
+        }
+        if (n->count < stats->top_names[min].count) {
+            min = i;
+        }
+    }
+    dns_engine_name_stat_t *n = &stats->top_names[min];
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    n->count++;
+    stats->top_name_hash[min] = hash;
+}
+
+void dns_engine_count_question(dns_engine_t *engine, const char *name, uint16_t type)
+{
+    switch (type) {
+    case QD_TYPE_A:
+        engine->stats.type_a++;
+        break;
+    case QD_TYPE_AAAA:
+        engine->stats.type_aaaa++;
+        break;
+    case QD_TYPE_HTTPS:
+        engine->stats.type_https++;
+        break;
+    default:
+        engine->stats.type_other++;
+        break;
+    }
+    stats_count_name(&engine->stats, name);
+}
+
+/*
+    Every read is checked against end, names are limited to DNS_MAX_NAME_LEN and labels to DNS_MAX_LABEL_LEN.
+    A compression pointer has to point before the labels it was found behind, so each jump moves backwards
+    and looping pointers cannot exist. Labels holding '.' or NUL are rejected, they would alias other names
+*/
+const char *dns_engine_parse_name(const char *msg, const char *ptr, const char *end, char *name, size_t name_len)
+{
+    const char *next = NULL;    // behind the first compression pointer, where the message goes on
+    const char *limit = ptr;    // start of the labels being read, pointers must point before it
+    size_t max_len = MIN(name_len, DNS_MAX_NAME_LEN);
+    size_t len = 0;
+
+    while (ptr < end) {
+        uint8_t label_len = *ptr;
+        if ((label_len & 0xC0) == 0xC0) {
+            if (ptr + 2 > end) {
+                return NULL;
+            }
+            const char *target = msg + (((label_len & 0x3F) << 8) | (uint8_t)ptr[1]);
+            if (target >= limit) {
+                return NULL;
+            }
+            next = next ? next : ptr + 2;
+            ptr = limit = target;
+            continue;
+        }
+        if (label_len > DNS_MAX_LABEL_LEN) {
+            // 0x40 and 0x80 are reserved label types
+            return NULL;
+        }
+        if (label_len == 0) {
+            // Terminate the final string, replacing the last '.'
+            name[len ? len - 1 : 0] = '\0';
+            return next ? next : ptr + 1;
+        }
+        // (len + 1) since we are adding a '.'
+        if (ptr + 1 + label_len > end || len + label_len + 1 > max_len) {
+            return NULL;
+        }
+        for (int i = 1; i <= label_len; i++) {
+            if (ptr[i] == '.' || ptr[i] == '\0') {
+                return NULL;
+            }
+        }
+        memcpy(name + len, ptr + 1, label_len);
+        len += label_len;
+        name[len++] = '.';
+        ptr += 1 + label_len;
+    }
+    return NULL;
+}
+
+const char *dns_engine_skip_name(const char *ptr, const char *end)
+{
+    while (ptr < end) {
+        uint8_t len = *ptr;
+        if (len == 0) {
+            return ptr + 1;
+        }
+        if ((len & 0xC0) == 0xC0) {
+            return ptr + 2 <= end ? ptr + 2 : NULL;
+        }
+        ptr += len + 1;
+    }
+    return NULL;
+}
+
+int dns_engine_find_opt(const char *ptr, const char *end, int rr_count, dns_opt_t *opt)
+{
+    for (int i = 0; i < rr_count; i++) {
+        const char *rr = ptr;
+        ptr = dns_engine_skip_name(ptr, end);
+        if (ptr == NULL || ptr + sizeof(dns_opt_t) - 1 > end) {
+            return -1;
+        }
+        if (rr + 1 == ptr && *rr == 0 && ntohs(((const dns_opt_t *)rr)->type) == QD_TYPE_OPT) {
+            memcpy(opt, rr, sizeof(dns_opt_t));
+            return 1;
+        }
+        // Behind its name, the fixed part of any record is laid out like the OPT one
+        uint16_t rdata_len = ntohs(((const dns_opt_t *)(ptr - 1))->rdata_len);
+        ptr += sizeof(dns_opt_t) - 1 + rdata_len;
+    }
+    return ptr <= end ? 0 : -1;
+}
+
+// Prepares a header-only reply carrying just the given response code
+static int reply_with_rcode(dns_header_t *header, uint16_t rcode)
+{
+    header->flags = htons((ntohs(header->flags) & (OPCODE_MASK | RD_FLAG)) | QR_FLAG | rcode);
+    header->qd_count = 0;
+    header->an_count = 0;
+    header->ns_count = 0;
+    header->ar_count = 0;
+    return sizeof(dns_header_t);
+}
+
+static inline bool ip6_addr_is_unset(const uint32_t *ip6)
+{
+    return (ip6[0] | ip6[1] | ip6[2] | ip6[3]) == 0;
+}
+
+int dns_engine_parse(dns_engine_t *engine, char *buf, size_t req_len, size_t buf_len, dns_engine_query_t *query)
+{
+    if (req_len > buf_len || req_len < sizeof(dns_header_t)) {
+        return -1;
+    }
+    const char *req_end = buf + req_len;
+
+    // Endianess of NW packet different from chip
+    dns_header_t *header = (dns_header_t *)buf;
+    ESP_LOGD(TAG, "DNS query with header id: 0x%X, flags: 0x%X, qd_count: %d",
+             ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
+
+    // Responses are never answered, other opcodes than a standard query are not implemented
+    if (ntohs(header->flags) & QR_FLAG) {
+        return -1;
+    }
+    if ((ntohs(header->flags) & OPCODE_MASK) != 0) {
+        return reply_with_rcode(header, RCODE_NOTIMP);
+    }
+
+    query->qd_count = ntohs(header->qd_count);
+    if (query->qd_count == 0 || query->qd_count > DNS_MAX_QUESTIONS) {
+        engine->stats.parse_failures++;
+        return reply_with_rcode(header, RCODE_FORMERR);
+    }
+
+    const char *cur_qd_ptr = buf + sizeof(dns_header_t);
+    char name[DNS_MAX_NAME_LEN + 1];
+
+    // Look every question up first, the answers can only start behind the last one
+    for (int qd_i = 0; qd_i < query->qd_count; qd_i++) {
+        const char *name_end_ptr = dns_engine_parse_name(buf, cur_qd_ptr, req_end, name, sizeof(name));
+        if (name_end_ptr == NULL || name_end_ptr + sizeof(dns_question_t) > req_end) {
+            ESP_LOGD(TAG, "Failed to parse DNS question %d", qd_i);
+            engine->stats.parse_failures++;
+            return reply_with_rcode(header, RCODE_FORMERR);
+        }
+
+        dns_question_t question;
+        dns_engine_question_t *q = &query->questions[qd_i];
+        memcpy(&question, name_end_ptr, sizeof(question));
+        q->name_offset = cur_qd_ptr - buf;
+        q->type = ntohs(question.type);
+        q->class = ntohs(question.class);
+        q->rule = dns_engine_lookup(engine, name);
+        dns_engine_count_question(engine, name, q->type);
+
+        ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", q->type, q->class, name);
+        cur_qd_ptr = name_end_ptr + sizeof(dns_question_t);
+    }
+    query->questions_end = cur_qd_ptr - buf;
+
+    // The OPT record lives behind the questions, read it before the answers overwrite it
+    query->has_opt = dns_engine_find_opt(cur_qd_ptr, req_end, ntohs(header->ns_count) + ntohs(header->ar_count), &query->opt);
+    if (query->has_opt < 0) {
+        engine->stats.parse_failures++;
+        return reply_with_rcode(header, RCODE_FORMERR);
+    }
+    return 0;
+}
+
+int dns_engine_answer_parsed(dns_engine_t *engine, char *buf, size_t buf_len, bool over_tcp, const dns_engine_query_t *query)
+{
+    dns_header_t *header = (dns_header_t *)buf;
+    int qd_count = query->qd_count;
+    int has_opt = query->has_opt;
+    const dns_opt_t *opt = &query->opt;
+    char *cur_qd_ptr = buf + query->questions_end;
+    bool any_rule = false;
+
+    for (int qd_i = 0; qd_i < qd_count; qd_i++) {
+        int rule = query->questions[qd_i].rule;
+        // Names going upstream are only answered by the forwarder, a local answer would contradict it
+        if (rule >= 0 && engine->rules[rule].forward && engine->forwarding) {
+            return reply_with_rcode(header, RCODE_REFUSED);
+        }
+        any_rule |= rule >= 0;
+    }
+
+    size_t reply_max_len = DNS_MAX_LEN;
+    if (over_tcp) {
+        reply_max_len = buf_len;
+    } else if (has_opt) {
+        reply_max_len = MIN(MAX(ntohs(opt->udp_payload_size), DNS_MAX_LEN), MIN(buf_len, DNS_EDNS_MAX_LEN));
+    }
+    // Keep room for our own OPT record, it must never be the part that gets truncated
+    const char *ans_end = buf + reply_max_len - (has_opt ? sizeof(dns_opt_t) : 0);
+    if (cur_qd_ptr > ans_end) {
+        engine->stats.parse_failures++;
+        return reply_with_rcode(header, RCODE_FORMERR);
+    }
+
+    // Authority and additional records of the request are not echoed
+    uint16_t rcode = any_rule ? RCODE_NOERROR : RCODE_NXDOMAIN;
+    header->ns_count = 0;
+    header->ar_count = 0;
+
+    char *cur_ans_ptr = cur_qd_ptr;
+    uint16_t an_count = 0;
+
+    for (int qd_i = 0; qd_i < qd_count && !(has_opt && opt->version != 0); qd_i++) {
+        const dns_engine_question_t *q = &query->questions[qd_i];
+        int rule = q->rule;
+        if (rule < 0 || q->class != QD_CLASS_IN) {
+            continue;
+        }
+        const dns_engine_rule_t *r = &engine->rules[rule];
+        uint16_t ptr_offset = htons(0xC000 | q->name_offset);
+
+        if (q->type == QD_TYPE_A && r->ip4 != 0) {
+            if (cur_ans_ptr + sizeof(dns_answer_t) > ans_end) {
+                rcode |= TC_FLAG;
+                break;
+            }
+            dns_answer_t *answer = (dns_answer_t *)cur_ans_ptr;
+
+            memcpy(answer, &engine->answer_template, sizeof(dns_answer_t));
+            answer->ptr_offset = ptr_offset;
+            answer->ip_addr = r->ip4;
+
+            ESP_LOGD(TAG, "Answer with PTR offset: 0x%" PRIX16 " and IP 0x%" PRIX32, ntohs(ptr_offset), answer->ip_addr);
+            cur_ans_ptr += sizeof(dns_answer_t);
+            an_count++;
+        } else if (q->type == QD_TYPE_AAAA && !ip6_addr_is_unset(r->ip6)) {
+            if (cur_ans_ptr + sizeof(dns_answer6_t) > ans_end) {
+                rcode |= TC_FLAG;
+                break;
+            }
+            dns_answer6_t *answer = (dns_answer6_t *)cur_ans_ptr;
+
+            memcpy(answer, &engine->answer6_template, sizeof(dns_answer6_t));
+            answer->ptr_offset = ptr_offset;
+            memcpy(answer->ip6_addr, r->ip6, sizeof(answer->ip6_addr));
+
+            cur_ans_ptr += sizeof(dns_answer6_t);
+            an_count++;
+        }
+        // Any other type of a covered name gets an empty NOERROR (NODATA) answer
+    }
+    if (rcode & TC_FLAG) {
+        // A partial answer set is worse than none, the client retries over TCP
+        cur_ans_ptr = cur_qd_ptr;
+        an_count = 0;
+    }
+
+    if (has_opt) {
+        dns_opt_t *reply_opt = (dns_opt_t *)cur_ans_ptr;
+        memcpy(reply_opt, &engine->opt_template, sizeof(dns_opt_t));
+        if (opt->version != 0) {
+            // Only EDNS version 0 exists, the upper bits of BADVERS go into the OPT record
+            reply_opt->ext_rcode = RCODE_EXT_BADVERS >> 4;
+            rcode = (rcode & TC_FLAG) | (RCODE_EXT_BADVERS & 0xF);
+        }
+        cur_ans_ptr += sizeof(dns_opt_t);
+        header->ar_count = htons(1);
+    }
+
+    header->flags = htons((ntohs(header->flags) & RD_FLAG) | QR_FLAG | AA_FLAG | rcode);
+    // Only the answers actually written go out, nothing uninitialized is sent
+    header->an_count = htons(an_count);
+    return cur_ans_ptr - buf;
+}
+
+int dns_engine_answer(dns_engine_t *engine, char *buf, size_t req_len, size_t buf_len, bool over_tcp)
+{
+    dns_engine_query_t query;
+    int ret = dns_engine_parse(engine, buf, req_len, buf_len, &query);
+    return ret != 0 ? ret : dns_engine_answer_parsed(engine, buf, buf_len, over_tcp, &query);
+}
@@ -0,0 +1,242 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    DNS message parsing and answering engine of the DNS server.
+    Works on plain buffers and only needs the C library, so it also builds with a host compiler;
+    sockets, tasks and netif addresses stay in dns_server.c
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DNS_MAX_LEN (512)           // Largest UDP message without EDNS0 (RFC 1035)
+#define DNS_EDNS_MAX_LEN (1232)     // UDP payload size we advertise and receive with EDNS0
+#define DNS_MAX_NAME_LEN (255)
+#define DNS_MAX_LABEL_LEN (63)
+// Questions answered per request, more are refused with FORMERR
+#define DNS_MAX_QUESTIONS (4)
+
+// Header flags, in host order
+#define QR_FLAG (0x8000)
+#define OPCODE_MASK (0x7800)
+#define AA_FLAG (0x0400)
+#define TC_FLAG (0x0200)
+#define RD_FLAG (0x0100)
+#define RA_FLAG (0x0080)
+#define RCODE_MASK (0x000F)
+#define RCODE_NOERROR (0)
+#define RCODE_FORMERR (1)
+#define RCODE_SERVFAIL (2)
+#define RCODE_NXDOMAIN (3)
+#define RCODE_NOTIMP (4)
+#define RCODE_REFUSED (5)
+// Extended response code, its upper bits go into the OPT record
+#define RCODE_EXT_BADVERS (16)
+
+#define QD_TYPE_A (0x0001)
+#define QD_TYPE_AAAA (0x001C)
+#define QD_TYPE_OPT (0x0029)
+#define QD_TYPE_HTTPS (0x0041)
+#define QD_CLASS_IN (0x0001)
+#define ANS_TTL_SEC (300)
+
+#define DNS_ENGINE_TOP_NAMES (8)
+#define DNS_ENGINE_TOP_NAME_LEN (64)
+
+// DNS Header Packet
+typedef struct __attribute__((__packed__))
+{
+    uint16_t id;
+    uint16_t flags;
+    uint16_t qd_count;
+    uint16_t an_count;
+    uint16_t ns_count;
+    uint16_t ar_count;
+} dns_header_t;
+
+// DNS Question Packet
+typedef struct {
+    uint16_t type;
+    uint16_t class;
+} dns_question_t;
+
+// DNS Answer Packet
+typedef struct __attribute__((__packed__))
+{
+    uint16_t ptr_offset;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t addr_len;
+    uint32_t ip_addr;
+} dns_answer_t;
+
+// DNS AAAA Answer Packet
+typedef struct __attribute__((__packed__))
+{
+    uint16_t ptr_offset;
+    uint16_t type;
+    uint16_t class;
+    uint32_t ttl;
+    uint16_t addr_len;
+    uint32_t ip6_addr[4];
+} dns_answer6_t;
+
+// EDNS0 OPT pseudo record, always owned by the root name (RFC 6891)
+typedef struct __attribute__((__packed__))
+{
+    uint8_t name;
+    uint16_t type;
+    uint16_t udp_payload_size;
+    uint8_t ext_rcode;
+    uint8_t version;
+    uint16_t flags;
+    uint16_t rdata_len;
+} dns_opt_t;
+
+// One slot of the compiled rule index (open addressing, linear probing)
+typedef struct {
+    uint32_t hash;
+    uint16_t entry;     // index into rules[] plus one, 0 marks an empty slot
+    bool wildcard;      // "*.suffix" rule, hashed on the suffix only
+} dns_rule_slot_t;
+
+/*
+    Rule as the engine sees it. The addresses are written by the owner while the engine may read them:
+    aligned 32-bit stores are atomic, a reader may at worst see a mix of an old and a new IPv6 address
+*/
+typedef struct {
+    const char *name;       // exact name, "*.suffix" or "*"
+    bool forward;           // answered by the forwarder while the engine's `forwarding` is set
+    uint32_t ip4;           // network order, 0 while there is none
+    uint32_t ip6[4];        // network order, all 0 while there is none
+} dns_engine_rule_t;
+
+typedef struct {
+    char name[DNS_ENGINE_TOP_NAME_LEN];
+    uint32_t count;
+} dns_engine_name_stat_t;
+
+// Counters kept by the engine itself, the owner takes care of publishing them
+typedef struct {
+    uint32_t parse_failures;
+    uint32_t type_a;
+    uint32_t type_aaaa;
+    uint32_t type_https;
+    uint32_t type_other;
+    dns_engine_name_stat_t top_names[DNS_ENGINE_TOP_NAMES];
+    uint32_t top_name_hash[DNS_ENGINE_TOP_NAMES];
+} dns_engine_stats_t;
+
+typedef struct {
+    dns_engine_rule_t *rules;
+    int num_rules;
+    int catch_all;                  // index of the "*" rule, -1 if there is none
+    uint32_t index_mask;            // number of index slots minus one
+    dns_rule_slot_t *index;
+    volatile bool forwarding;       // an upstream resolver takes the `forward` rules, refuse them here
+    dns_answer_t answer_template;   // constant part of every A answer, in network order
+    dns_answer6_t answer6_template; // constant part of every AAAA answer, in network order
+    dns_opt_t opt_template;         // EDNS0 OPT record added to replies of EDNS0 requests
+    dns_engine_stats_t stats;
+} dns_engine_t;
+
+typedef struct {
+    uint16_t name_offset;           // from the start of the message, target of the answers' compression pointer
+    uint16_t type;
+    uint16_t class;
+    int rule;                       // rule answering the name, -1 if there is none
+} dns_engine_question_t;
+
+typedef struct {
+    int qd_count;
+    dns_engine_question_t questions[DNS_MAX_QUESTIONS];
+    uint16_t questions_end;         // offset behind the last question, where the answers start
+    int has_opt;
+    dns_opt_t opt;                  // EDNS0 OPT record of the request, valid if has_opt
+} dns_engine_query_t;
+
+/**
+ * Number of index slots dns_engine_init() needs for num_rules rules
+ */
+size_t dns_engine_index_slots(int num_rules);
+
+/**
+ * Compiles the rules into the index (zeroed, dns_engine_index_slots() long) and prepares the answer templates.
+ * Both arrays must outlive the engine, the rule addresses may be filled in before or after
+ */
+void dns_engine_init(dns_engine_t *engine, dns_engine_rule_t *rules, int num_rules, dns_rule_slot_t *index);
+
+/**
+ * Finds the rule answering the given name: an exact match first, then the longest
+ * matching "*.suffix" rule and at last the catch-all "*"; -1 if nothing applies
+ */
+int dns_engine_lookup(const dns_engine_t *engine, const char *name);
+
+/**
+ * Counts a question in the type statistics and the most queried names
+ */
+void dns_engine_count_question(dns_engine_t *engine, const char *name, uint16_t type);
+
+/**
+ * Decodes the (possibly compressed) name at ptr of the message starting at msg into a regular .-separated name.
+ * Returns the pointer behind the name in the message, or NULL if it runs past end, does not fit
+ * name_len or uses anything but labels and backward compression pointers
+ */
+const char *dns_engine_parse_name(const char *msg, const char *ptr, const char *end, char *name, size_t name_len);
+
+/**
+ * Returns the pointer behind the (possibly compressed) name at ptr, or NULL if it runs past end
+ */
+const char *dns_engine_skip_name(const char *ptr, const char *end);
+
+/**
+ * Walks rr_count records from ptr looking for an EDNS0 OPT record,
+ * returns 1 and fills opt if one is present, 0 if not and -1 on a malformed section
+ */
+int dns_engine_find_opt(const char *ptr, const char *end, int rr_count, dns_opt_t *opt);
+
+/**
+ * Parses the DNS request of req_len bytes in buf, looks its questions up and counts them.
+ *
+ * @return 0 if query is filled in, the length of the error reply prepared in buf
+ *         (FORMERR, NOTIMP) or -1 if the request is to be dropped
+ */
+int dns_engine_parse(dns_engine_t *engine, char *buf, size_t req_len, size_t buf_len, dns_engine_query_t *query);
+
+/**
+ * Turns the request in buf, as dns_engine_parse() left it in query, into the DNS response in place.
+ * Lets the forwarder inspect the questions without parsing the request a second time
+ *
+ * @return Length of the reply
+ */
+int dns_engine_answer_parsed(dns_engine_t *engine, char *buf, size_t buf_len, bool over_tcp, const dns_engine_query_t *query);
+
+/**
+ * Turns the DNS request of req_len bytes in buf into the DNS response in place,
+ * dns_engine_parse() followed by dns_engine_answer_parsed().
+ *
+ * Every question gets a definite outcome: an answer, NODATA if a rule covers the name but not
+ * the type (e.g. AAAA or HTTPS), or NXDOMAIN if no rule covers any of the questions.
+ * An EDNS0 OPT record of the request is answered with our own one; a reply not fitting the
+ * client's UDP limit is cut behind the questions and flagged truncated, so the client retries over TCP
+ * where the whole buffer of buf_len bytes is available.
+ *
+ * @return Length of the reply, or -1 if the request is to be dropped
+ */
+int dns_engine_answer(dns_engine_t *engine, char *buf, size_t req_len, size_t buf_len, bool over_tcp);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,106 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <sys/param.h>
+#include <string.h>
+#include "dns_rate_limit.h"
+
+void dns_rate_limit_init(dns_rate_limit_t *limit, int qps, int burst)
+{
+    memset(limit, 0, sizeof(*limit));
+    limit->rate_per_sec = qps * DNS_RATE_TOKEN;
+    limit->burst = burst * DNS_RATE_TOKEN;
+    limit->overflow.tokens = limit->burst;
+}
+
+// Tokens the bucket holds by now, without refilling it
+static int64_t bucket_level(const dns_rate_limit_t *limit, const dns_rate_slot_t *bucket, int64_t now_us)
+{
+    return MIN(bucket->tokens + (now_us - bucket->last_us) * limit->rate_per_sec / 1000000, limit->burst);
+}
+
+static void bucket_refill(const dns_rate_limit_t *limit, dns_rate_slot_t *bucket, int64_t now_us)
+{
+    int64_t refill = (now_us - bucket->last_us) * limit->rate_per_sec / 1000000;
+    if (refill > 0) {
+        // Only move the clock when something was added, tiny intervals must not eat the refill
+        bucket->tokens = MIN(bucket->tokens + refill, limit->burst);
+        bucket->last_us = now_us;
+    }
+}
+
+/*
+    Slot for a source not in the table: a free one, otherwise the one holding the fewest tokens and the least
+    recently seen of those. Sources rotating through the table then push out each other, not the clients
+    in good standing
+*/
+static dns_rate_slot_t *slot_victim(dns_rate_limit_t *limit, int64_t now_us)
+{
+    dns_rate_slot_t *victim = &limit->slots[0];
+    int64_t victim_level = bucket_level(limit, victim, now_us);
+    for (int i = 0; i < DNS_RATE_LIMIT_SLOTS && victim->family != 0; i++) {
+        dns_rate_slot_t *s = &limit->slots[i];
+        int64_t level = bucket_level(limit, s, now_us);
+        if (s->family == 0 || level < victim_level || (level == victim_level && s->last_us < victim->last_us)) {
+            victim = s;
+            victim_level = level;
+        }
+    }
+    return victim;
+}
+
+dns_rate_verdict_t dns_rate_limit_charge(dns_rate_limit_t *limit, uint8_t family, const uint8_t addr[16], int64_t now_us)
+{
+    dns_rate_slot_t *slot = NULL;
+    for (int i = 0; i < DNS_RATE_LIMIT_SLOTS; i++) {
+        dns_rate_slot_t *s = &limit->slots[i];
+        if (s->family == family && memcmp(s->addr, addr, sizeof(s->addr)) == 0) {
+            slot = s;
+            break;
+        }
+    }
+    if (slot == NULL) {
+        slot = slot_victim(limit, now_us);
+        int32_t tokens = limit->burst;
+        bool limited = false;
+        if (slot->family != 0) {
+            /*
+                Taking over a slot in use, the newcomer's tokens come out of the shared overflow bucket:
+                spoofed sources cycling through the table share its rate instead of starting with a full
+                bucket each. Newcomers finding it empty are one flood, reported once
+            */
+            bucket_refill(limit, &limit->overflow, now_us);
+            if (limit->overflow.tokens == limit->burst) {
+                limit->overflow.limited = false;
+            }
+            tokens = limit->overflow.tokens;
+            limit->overflow.tokens = 0;
+            limited = limit->overflow.limited;
+            limit->overflow.limited |= tokens < DNS_RATE_TOKEN;
+        }
+        *slot = (dns_rate_slot_t) {
+            .family = family, .limited = limited, .tokens = tokens, .last_us = now_us
+        };
+        memcpy(slot->addr, addr, sizeof(slot->addr));
+    }
+
+    bucket_refill(limit, slot, now_us);
+
+    if (slot->tokens < DNS_RATE_TOKEN) {
+        slot->drops++;
+        if (!slot->limited) {
+            slot->limited = true;
+            return DNS_RATE_DROP_FLOOD_START;
+        }
+        return DNS_RATE_DROP;
+    }
+    // A flood only ends once the bucket filled up again, not with every token trickling in meanwhile
+    if (slot->tokens == limit->burst) {
+        slot->limited = false;
+    }
+    slot->tokens -= DNS_RATE_TOKEN;
+    return DNS_RATE_ALLOW;
+}
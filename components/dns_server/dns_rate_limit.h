@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Per-source token buckets of the DNS server. Plain C on caller-supplied time and addresses,
+    so it also builds with a host compiler
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DNS_RATE_LIMIT_SLOTS (16)
+#define DNS_RATE_TOKEN (1000)       // bucket levels are kept in thousandths of a token
+
+// Token bucket of one client address
+typedef struct {
+    uint8_t addr[16];       // IPv4 addresses use the first 4 bytes
+    uint8_t family;         // 0 marks an unused slot
+    bool limited;           // dropped since the bucket was last full, only used to report the start of a flood once
+    int32_t tokens;         // in DNS_RATE_TOKEN units
+    int64_t last_us;
+    uint32_t drops;
+} dns_rate_slot_t;
+
+typedef struct {
+    int32_t rate_per_sec;   // bucket refill rate, in DNS_RATE_TOKEN units
+    int32_t burst;          // bucket size, in DNS_RATE_TOKEN units
+    dns_rate_slot_t slots[DNS_RATE_LIMIT_SLOTS];
+    dns_rate_slot_t overflow;   // shared bucket of the sources taking over a slot in use, its address is unused
+} dns_rate_limit_t;
+
+typedef enum {
+    DNS_RATE_ALLOW,
+    DNS_RATE_DROP,
+    DNS_RATE_DROP_FLOOD_START,  // dropped, and the first drop since the source's bucket was last full
+} dns_rate_verdict_t;
+
+/**
+ * Empties the table and sets every bucket, the overflow one included, to hold burst queries, refilled at qps per second
+ */
+void dns_rate_limit_init(dns_rate_limit_t *limit, int qps, int burst);
+
+/**
+ * Charges one query to the token bucket of the source address, the table is small and fixed:
+ * a new source gets a free slot with a full bucket, or takes over the slot holding the fewest tokens
+ * with whatever the shared overflow bucket holds
+ *
+ * @param family AF_INET or AF_INET6, never 0
+ * @param addr source address, IPv4 ones in the first 4 bytes and the rest zeroed
+ * @param now_us monotonic time in microseconds
+ */
+dns_rate_verdict_t dns_rate_limit_charge(dns_rate_limit_t *limit, uint8_t family, const uint8_t addr[16], int64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,42 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <string.h>
+#include <netinet/in.h>
+#include "dns_responder.h"
+
+dns_rate_verdict_t dns_responder_charge(const dns_responder_t *responder, const struct sockaddr *source_addr, int64_t now_us)
+{
+    uint8_t addr[16] = { 0 };
+    uint8_t family = source_addr->sa_family;
+    if (family == AF_INET) {
+        memcpy(addr, &((const struct sockaddr_in *)source_addr)->sin_addr, 4);
+    } else {
+        memcpy(addr, &((const struct sockaddr_in6 *)source_addr)->sin6_addr, 16);
+    }
+    return dns_rate_limit_charge(responder->rate_limit, family, addr, now_us);
+}
+
+dns_responder_verdict_t dns_responder_handle(const dns_responder_t *responder, char *buf, size_t len, size_t buf_len,
+                                             const struct sockaddr *source_addr, socklen_t addr_len,
+                                             int64_t now_us, int *reply_len)
+{
+    dns_rate_verdict_t rate = dns_responder_charge(responder, source_addr, now_us);
+    if (rate != DNS_RATE_ALLOW) {
+        return rate == DNS_RATE_DROP_FLOOD_START ? DNS_RESPONDER_FLOOD_START : DNS_RESPONDER_RATE_LIMITED;
+    }
+
+    // Parsed once, for the forwarder and the local answer alike
+    dns_engine_query_t query;
+    *reply_len = dns_engine_parse(responder->engine, buf, len, buf_len, &query);
+    if (*reply_len == 0) {
+        if (responder->forward && responder->forward(responder->forward_arg, source_addr, addr_len, len, &query)) {
+            return DNS_RESPONDER_FORWARDED;
+        }
+        *reply_len = dns_engine_answer_parsed(responder->engine, buf, buf_len, false, &query);
+    }
+    return *reply_len > 0 ? DNS_RESPONDER_REPLY : DNS_RESPONDER_DROP;
+}
@@ -0,0 +1,65 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Per-datagram path of the UDP responder: rate limit, parse, offer to the forwarder, answer.
+    dns_server_task() and the host benchmarks run the same code on every request they receive;
+    receiving and sending stay with the caller
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "dns_engine.h"
+#include "dns_rate_limit.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Offered every parsed request the rate limiter let through, before the engine answers it locally
+ * @return true if it took the request (and replies itself), false to have it answered locally
+ */
+typedef bool (*dns_responder_forward_t)(void *arg, const struct sockaddr *source_addr, socklen_t addr_len,
+                                        size_t len, const dns_engine_query_t *query);
+
+typedef struct {
+    dns_engine_t *engine;
+    dns_rate_limit_t *rate_limit;
+    dns_responder_forward_t forward;    // NULL without a forwarder
+    void *forward_arg;
+} dns_responder_t;
+
+typedef enum {
+    DNS_RESPONDER_REPLY,                // the reply is in the buffer, to be sent back to the source
+    DNS_RESPONDER_FORWARDED,            // taken by the forwarder, nothing to send
+    DNS_RESPONDER_DROP,                 // a response or too short to answer, nothing to send
+    DNS_RESPONDER_RATE_LIMITED,         // the source ran out of tokens, nothing to send
+    DNS_RESPONDER_FLOOD_START,          // rate limited, and the first drop of the source's flood
+} dns_responder_verdict_t;
+
+/**
+ * Handles the datagram of len bytes in buf (buf_len long) received from source_addr, an AF_INET or AF_INET6 address
+ *
+ * @param now_us monotonic time in microseconds, for the rate limiter
+ * @param[out] reply_len length of the reply in buf, set with DNS_RESPONDER_REPLY
+ */
+dns_responder_verdict_t dns_responder_handle(const dns_responder_t *responder, char *buf, size_t len, size_t buf_len,
+                                             const struct sockaddr *source_addr, socklen_t addr_len,
+                                             int64_t now_us, int *reply_len);
+
+/**
+ * Charges one query of source_addr to the rate limiter, for requests that do not come in as datagrams
+ */
+dns_rate_verdict_t dns_responder_charge(const dns_responder_t *responder, const struct sockaddr *source_addr, int64_t now_us);
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,285 +6,1038 @@
 
 #include <sys/param.h>
 #include <inttypes.h>
+#include <ctype.h>
+#include <stdatomic.h>
 
 #include "esp_log.h"
 #include "esp_system.h"
 #include "esp_check.h"
 #include "esp_netif.h"
+#include "esp_event.h"
+#include "esp_wifi.h"
+#include "esp_timer.h"
+#include "esp_random.h"
 
 #include "lwip/err.h"
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include "lwip/netdb.h"
 #include "dns_server.h"
+#include "dns_engine.h"
+#include "dns_rate_limit.h"
+#include "dns_responder.h"
 
 #define DNS_PORT (53)
-#define DNS_MAX_LEN (256)
+#define DNS_DRAIN_BATCH (16)
+#define DNS_SELECT_TIMEOUT_SEC (1)
+#define DNS_STATS_READ_RETRIES (10)
 
-#define OPCODE_MASK (0x7800)
-#define QR_FLAG (1 << 7)
-#define QD_TYPE_A (0x0001)
-#define ANS_TTL_SEC (300)
+#define DNS_TCP_MAX_CONNS (2)
+#define DNS_TCP_IDLE_TIMEOUT_US (5 * 1000 * 1000)
+#define DNS_TCP_MAX_LEN (DNS_EDNS_MAX_LEN)  // larger TCP requests are refused by closing the connection
+
+#define DNS_RATE_LIMIT_QPS (20)
+#define DNS_RATE_LIMIT_BURST (40)
+
+#define DNS_FWD_PENDING (8)         // upstream queries in flight
+#define DNS_FWD_WAITERS (4)         // clients sharing one upstream query
+#define DNS_FWD_CACHE_SLOTS (16)
+#define DNS_FWD_TIMEOUT_US (2000 * 1000)
+#define DNS_FWD_POLL_MS (250)       // select() timeout while queries are in flight
+#define DNS_FWD_MAX_TTL_SEC (3600)
+#define DNS_FWD_NEGATIVE_TTL_SEC (30)
+#define DNS_FWD_KEY_LEN (DNS_MAX_NAME_LEN + 1 + sizeof(dns_question_t) + 1)
+
+_Static_assert(DNS_ENGINE_TOP_NAMES == DNS_SERVER_TOP_NAMES && DNS_ENGINE_TOP_NAME_LEN == DNS_SERVER_TOP_NAME_LEN,
+               "Engine statistics must match the public ones");
 
 static const char *TAG = "DNS_SERVER";
 
-// DNS Header Packet
-typedef struct __attribute__((__packed__))
-{
+/*
+    Forwarded questions are keyed by their lower-cased wire form (name, type, class)
+    plus one byte telling whether the client used EDNS0, since that changes the reply
+*/
+typedef struct {
+    uint16_t len;
+    uint8_t data[DNS_FWD_KEY_LEN];
+} dns_fwd_key_t;
+
+// Client waiting for the answer of a forwarded question
+typedef struct {
+    struct sockaddr_in6 addr;
+    socklen_t addr_len;
+    int sock;
     uint16_t id;
-    uint16_t flags;
-    uint16_t qd_count;
-    uint16_t an_count;
-    uint16_t ns_count;
-    uint16_t ar_count;
-} dns_header_t;
-
-// DNS Question Packet
+} dns_fwd_waiter_t;
+
+// Question sent upstream and not answered yet
 typedef struct {
-    uint16_t type;
-    uint16_t class;
-} dns_question_t;
+    bool in_use;
+    uint16_t upstream_id;
+    int64_t deadline_us;
+    dns_fwd_key_t key;
+    uint8_t num_waiters;
+    dns_fwd_waiter_t waiters[DNS_FWD_WAITERS];
+} dns_fwd_pending_t;
 
-// DNS Answer Packet
-typedef struct __attribute__((__packed__))
-{
-    uint16_t ptr_offset;
-    uint16_t type;
-    uint16_t class;
-    uint32_t ttl;
-    uint16_t addr_len;
-    uint32_t ip_addr;
-} dns_answer_t;
+// Cached upstream reply, valid until its smallest TTL runs out
+typedef struct {
+    dns_fwd_key_t key;          // len 0 marks an unused slot
+    int64_t stored_us;
+    int64_t expires_us;
+    uint32_t last_used;         // LRU clock
+    uint16_t len;
+    uint8_t reply[DNS_MAX_LEN];
+} dns_fwd_cache_t;
+
+// State of the forwarding mode, only allocated if a rule asks for forwarding
+typedef struct {
+    int sock;
+    esp_ip4_addr_t upstream;    // refreshed along with the answers, 0 while there is none
+    uint32_t lru_clock;
+    uint8_t num_pending;
+    dns_fwd_pending_t pending[DNS_FWD_PENDING];
+    dns_fwd_cache_t cache[DNS_FWD_CACHE_SLOTS];
+} dns_forwarder_t;
+
+// DNS over TCP connection, messages are prefixed by their 16-bit length (RFC 1035 4.2.2)
+typedef struct {
+    int sock;               // -1 marks an unused slot
+    int64_t last_us;
+    size_t len;             // bytes buffered, including the length prefix
+    struct sockaddr_in6 peer;
+    char buf[2 + DNS_TCP_MAX_LEN];
+} dns_tcp_conn_t;
 
 // DNS server handle
 struct dns_server_handle {
-    bool started;
+    volatile bool started;
     TaskHandle_t task;
+    SemaphoreHandle_t stopped;      // given by the task right before it deletes itself
+    int sock4;
+    int sock6;                      // -1 without IPv6
+    int ctrl_sock;                  // wakes the task up for shutdown
+    int tcp_listen;                 // TCP fallback for replies that do not fit a datagram
+    dns_tcp_conn_t tcp[DNS_TCP_MAX_CONNS];
+    const char *upstream_if_key;
+    dns_forwarder_t *fwd;           // NULL unless a rule forwards
+    struct sockaddr_in ctrl_addr;
+    dns_server_stats_t stats;       // working counters, only touched by the server task
+    dns_server_stats_t published;   // copy for readers, written between stats_write_begin() and _end()
+    volatile uint32_t stats_seq;    // odd while the task updates published
+    dns_engine_t engine;            // parses and answers requests, its counters are published along with stats
+    dns_rate_limit_t rate_limit;    // per-source token buckets, only touched by the server task
+    dns_responder_t responder;      // per-datagram path over the engine, the rate limiter and the forwarder
+    char rx_buffer[DNS_EDNS_MAX_LEN];  // requests are answered in place, TCP ones copied here first
+    bool answer_aaaa;
+    dns_engine_rule_t *rules;       // engine view of every entry with its resolved addresses, points behind entry[]
+    esp_event_handler_instance_t ip_event;
+    esp_event_handler_instance_t ap_event;
     int num_of_entries;
     dns_entry_pair_t entry[];
 };
 
 /*
-    Parse the name from the packet from the DNS name format to a regular .-seperated name
-    returns the pointer to the next part of the packet
+    Statistics are published with a sequence lock: the server task counts into its working copy while it
+    serves a batch, then makes stats_seq odd just for copying the counters out. Readers copy the published
+    struct and retry if the sequence moved, so neither side ever blocks on the other
 */
-static char *parse_dns_name(char *raw_name, char *parsed_name, size_t parsed_name_max_len)
+static inline void stats_write_begin(dns_server_handle_t h)
 {
+    h->stats_seq++;
+    atomic_thread_fence(memory_order_release);
+}
 
-    char *label = raw_name;
-    char *name_itr = parsed_name;
-    int name_len = 0;
-
-    do {
-        int sub_name_len = *label;
-        // (len + 1) since we are adding  a '.'
-        name_len += (sub_name_len + 1);
-        if (name_len > parsed_name_max_len) {
-            return NULL;
-        }
-
-        // Copy the sub name that follows the the label
-        memcpy(name_itr, label + 1, sub_name_len);
-        name_itr[sub_name_len] = '.';
-        name_itr += (sub_name_len + 1);
-        label += sub_name_len + 1;
-    } while (*label != 0);
-
-    // Terminate the final string, replacing the last '.'
-    parsed_name[name_len - 1] = '\0';
-    // Return pointer to first char after the name
-    return label + 1;
+static inline void stats_write_end(dns_server_handle_t h)
+{
+    atomic_thread_fence(memory_order_release);
+    h->stats_seq++;
 }
 
-// Parses the DNS request and prepares a DNS response with the IP of the softAP
-static int parse_dns_request(char *req, size_t req_len, char *dns_reply, size_t dns_reply_max_len, dns_server_handle_t h)
+static void stats_publish(dns_server_handle_t h)
 {
-    if (req_len > dns_reply_max_len) {
-        return -1;
+    const dns_engine_stats_t *engine = &h->engine.stats;
+    stats_write_begin(h);
+    h->published = h->stats;
+    h->published.parse_failures = engine->parse_failures;
+    h->published.type_a = engine->type_a;
+    h->published.type_aaaa = engine->type_aaaa;
+    h->published.type_https = engine->type_https;
+    h->published.type_other = engine->type_other;
+    for (int i = 0; i < DNS_SERVER_TOP_NAMES; i++) {
+        memcpy(h->published.top_names[i].name, engine->top_names[i].name, DNS_SERVER_TOP_NAME_LEN);
+        h->published.top_names[i].count = engine->top_names[i].count;
     }
+    stats_write_end(h);
+}
 
-    // Prepare the reply
-    memset(dns_reply, 0, dns_reply_max_len);
-    memcpy(dns_reply, req, req_len);
+static const uint32_t s_latency_bounds_us[DNS_SERVER_LATENCY_BUCKETS - 1] = DNS_SERVER_LATENCY_BOUNDS_US;
 
-    // Endianess of NW packet different from chip
-    dns_header_t *header = (dns_header_t *)dns_reply;
-    ESP_LOGD(TAG, "DNS query with header id: 0x%X, flags: 0x%X, qd_count: %d",
-             ntohs(header->id), ntohs(header->flags), ntohs(header->qd_count));
+static void stats_record_latency(dns_server_handle_t h, int64_t start_us)
+{
+    uint32_t elapsed = esp_timer_get_time() - start_us;
+    int bucket = 0;
+    while (bucket < DNS_SERVER_LATENCY_BUCKETS - 1 && elapsed >= s_latency_bounds_us[bucket]) {
+        bucket++;
+    }
+    h->stats.latency_hist[bucket]++;
+}
 
-    // Not a standard query
-    if ((header->flags & OPCODE_MASK) != 0) {
-        return 0;
+/*
+    Resolves the address of every rule once, so answering a query is just a copy.
+    Aligned 32-bit stores are atomic, the server task never sees a torn address
+*/
+static void answer_ip_refresh(dns_server_handle_t h)
+{
+    for (int i = 0; i < h->num_of_entries; ++i) {
+        esp_ip4_addr_t ip = h->entry[i].ip;
+        if (h->entry[i].if_key) {
+            esp_netif_ip_info_t ip_info = { 0 };
+            esp_netif_t *netif = esp_netif_get_handle_from_ifkey(h->entry[i].if_key);
+            if (netif == NULL || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK) {
+                ESP_LOGD(TAG, "No address for %s yet", h->entry[i].if_key);
+            }
+            ip.addr = ip_info.ip.addr;
+        }
+        h->rules[i].ip4 = ip.addr;
+
+        if (h->answer_aaaa) {
+            esp_ip6_addr_t ip6 = { 0 };
+            esp_netif_t *netif = h->entry[i].if_key ? esp_netif_get_handle_from_ifkey(h->entry[i].if_key) : NULL;
+            if (netif == NULL || esp_netif_get_ip6_linklocal(netif, &ip6) != ESP_OK) {
+                memset(&ip6, 0, sizeof(ip6));
+            }
+            // Written word by word, a reader may at worst see a mix of the old and the new address
+            memcpy(h->rules[i].ip6, ip6.addr, sizeof(ip6.addr));
+        }
     }
 
-    // Set question response flag
-    header->flags |= QR_FLAG;
+    if (h->fwd) {
+        esp_netif_dns_info_t dns = { 0 };
+        esp_netif_t *netif = esp_netif_get_handle_from_ifkey(h->upstream_if_key);
+        if (netif == NULL || esp_netif_get_dns_info(netif, ESP_NETIF_DNS_MAIN, &dns) != ESP_OK || dns.ip.type != ESP_IPADDR_TYPE_V4) {
+            dns.ip.u_addr.ip4.addr = 0;
+        }
+        h->fwd->upstream.addr = dns.ip.u_addr.ip4.addr;
+        h->engine.forwarding = h->fwd->upstream.addr != 0;
+    }
+}
 
-    uint16_t qd_count = ntohs(header->qd_count);
-    header->an_count = htons(qd_count);
+// Interface addresses only change on these events, refresh the cached answers there
+static void answer_ip_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
+{
+    ESP_LOGD(TAG, "Refreshing answers on %s %" PRId32, event_base, event_id);
+    answer_ip_refresh(arg);
+}
 
-    int reply_len = qd_count * sizeof(dns_answer_t) + req_len;
-    if (reply_len > dns_reply_max_len) {
-        return -1;
+static void rate_limit_record(dns_server_handle_t h, bool flood_start)
+{
+    h->stats.rate_limited++;
+    if (flood_start) {
+        ESP_LOGW(TAG, "Rate limiting a client after %d queries in a burst", (int)(h->rate_limit.burst / DNS_RATE_TOKEN));
+    }
+}
+
+/*
+    Builds the cache/coalescing key of the single question in buf,
+    returns false if the message does not carry exactly one well-formed question
+*/
+static bool fwd_key_build(const char *buf, size_t len, bool has_opt, dns_fwd_key_t *key)
+{
+    const dns_header_t *header = (const dns_header_t *)buf;
+    if (ntohs(header->qd_count) != 1) {
+        return false;
+    }
+    const char *ptr = buf + sizeof(dns_header_t);
+    const char *end = buf + len;
+    size_t key_len = 0;
+
+    while (ptr < end && *ptr != 0) {
+        uint8_t label_len = *ptr;
+        if ((label_len & 0xC0) != 0 || ptr + 1 + label_len > end || key_len + 1 + label_len > DNS_MAX_NAME_LEN) {
+            return false;
+        }
+        key->data[key_len++] = label_len;
+        for (int i = 1; i <= label_len; i++) {
+            key->data[key_len++] = tolower((unsigned char)ptr[i]);
+        }
+        ptr += 1 + label_len;
+    }
+    if (ptr + 1 + sizeof(dns_question_t) > end) {
+        return false;
+    }
+    // Root label, type and class are copied as they are
+    memcpy(key->data + key_len, ptr, 1 + sizeof(dns_question_t));
+    key_len += 1 + sizeof(dns_question_t);
+    key->data[key_len++] = has_opt;
+    key->len = key_len;
+    return true;
+}
+
+static inline bool fwd_key_equal(const dns_fwd_key_t *a, const dns_fwd_key_t *b)
+{
+    return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+/*
+    Calls fn on the TTL field of every answer and authority record of the reply in buf,
+    returns false if the records run past len
+*/
+static bool fwd_for_each_ttl(uint8_t *buf, size_t len, void (*fn)(uint8_t *ttl, void *ctx), void *ctx)
+{
+    const dns_header_t *header = (const dns_header_t *)buf;
+    char *ptr = (char *)buf + sizeof(dns_header_t);
+    const char *end = (const char *)buf + len;
+
+    for (int i = 0; i < ntohs(header->qd_count); i++) {
+        ptr = (char *)dns_engine_skip_name(ptr, end);
+        if (ptr == NULL) {
+            return false;
+        }
+        ptr += sizeof(dns_question_t);
+    }
+    int rr_count = ntohs(header->an_count) + ntohs(header->ns_count);
+    for (int i = 0; i < rr_count; i++) {
+        ptr = (char *)dns_engine_skip_name(ptr, end);
+        // Behind its name, the fixed part of any record is laid out like the OPT one
+        if (ptr == NULL || ptr + sizeof(dns_opt_t) - 1 > end) {
+            return false;
+        }
+        dns_opt_t *rr = (dns_opt_t *)(ptr - 1);
+        fn(&rr->ext_rcode, ctx);
+        ptr += sizeof(dns_opt_t) - 1 + ntohs(rr->rdata_len);
+    }
+    return ptr <= end;
+}
+
+static void fwd_ttl_min(uint8_t *ttl, void *ctx)
+{
+    uint32_t value = (uint32_t)ttl[0] << 24 | (uint32_t)ttl[1] << 16 | (uint32_t)ttl[2] << 8 | ttl[3];
+    *(uint32_t *)ctx = MIN(*(uint32_t *)ctx, value);
+}
+
+static void fwd_ttl_age(uint8_t *ttl, void *ctx)
+{
+    uint32_t value = (uint32_t)ttl[0] << 24 | (uint32_t)ttl[1] << 16 | (uint32_t)ttl[2] << 8 | ttl[3];
+    uint32_t age = *(uint32_t *)ctx;
+    value = value > age ? value - age : 0;
+    ttl[0] = value >> 24;
+    ttl[1] = value >> 16;
+    ttl[2] = value >> 8;
+    ttl[3] = value;
+}
+
+/*
+    Stores an upstream reply the caller matched to its query by id and question, unless it is an error,
+    truncated, malformed or not to be cached. Only a reply worth keeping evicts the expired or least recently used slot
+*/
+static void fwd_cache_store(dns_forwarder_t *fwd, const dns_fwd_key_t *key, const char *reply, size_t len)
+{
+    uint16_t flags = ntohs(((const dns_header_t *)reply)->flags);
+    uint16_t rcode = flags & RCODE_MASK;
+    if (len > DNS_MAX_LEN || (flags & TC_FLAG) || (rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN)) {
+        return;
+    }
+    // Negative answers carry no records (the SOA is in the authority section if any), they get a short fixed lifetime
+    uint32_t ttl = DNS_FWD_MAX_TTL_SEC;
+    if (!fwd_for_each_ttl((uint8_t *)reply, len, fwd_ttl_min, &ttl)) {
+        return;
+    }
+    if (rcode == RCODE_NXDOMAIN || ((const dns_header_t *)reply)->an_count == 0) {
+        ttl = MIN(ttl, DNS_FWD_NEGATIVE_TTL_SEC);
+    }
+    if (ttl == 0) {
+        return;
     }
 
-    // Pointer to current answer and question
-    char *cur_ans_ptr = dns_reply + req_len;
-    char *cur_qd_ptr = dns_reply + sizeof(dns_header_t);
-    char name[128];
-
-    // Respond to all questions based on configured rules
-    for (int qd_i = 0; qd_i < qd_count; qd_i++) {
-        char *name_end_ptr = parse_dns_name(cur_qd_ptr, name, sizeof(name));
-        if (name_end_ptr == NULL) {
-            ESP_LOGE(TAG, "Failed to parse DNS question: %s", cur_qd_ptr);
-            return -1;
-        }
-
-        dns_question_t *question = (dns_question_t *)(name_end_ptr);
-        uint16_t qd_type = ntohs(question->type);
-        uint16_t qd_class = ntohs(question->class);
-
-        ESP_LOGD(TAG, "Received type: %d | Class: %d | Question for: %s", qd_type, qd_class, name);
-
-        if (qd_type == QD_TYPE_A) {
-            esp_ip4_addr_t ip = { .addr = IPADDR_ANY };
-            // Check the configured rules to decide whether to answer this question or not
-            for (int i = 0; i < h->num_of_entries; ++i) {
-                // check if the name either corresponds to the entry, or if we should answer to all queries ("*")
-                if (strcmp(h->entry[i].name, "*") == 0 || strcmp(h->entry[i].name, name) == 0) {
-                    if (h->entry[i].if_key) {
-                        esp_netif_ip_info_t ip_info;
-                        esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey(h->entry[i].if_key), &ip_info);
-                        ip.addr = ip_info.ip.addr;
-                        break;
-                    } else if (h->entry->ip.addr != IPADDR_ANY) {
-                        ip.addr = h->entry[i].ip.addr;
-                        break;
-                    }
-                }
+    int64_t now = esp_timer_get_time();
+    dns_fwd_cache_t *slot = &fwd->cache[0];
+    for (int i = 0; i < DNS_FWD_CACHE_SLOTS; i++) {
+        dns_fwd_cache_t *c = &fwd->cache[i];
+        if (c->key.len == 0 || c->expires_us <= now || fwd_key_equal(&c->key, key)) {
+            slot = c;
+            break;
+        }
+        if (c->last_used < slot->last_used) {
+            slot = c;
+        }
+    }
+
+    memcpy(slot->reply, reply, len);
+    slot->key = *key;
+    slot->len = len;
+    slot->stored_us = now;
+    slot->expires_us = now + (int64_t)ttl * 1000000;
+    slot->last_used = ++fwd->lru_clock;
+}
+
+/*
+    Answers the request from the cache into buf, with its id and with TTLs reduced by the time spent in the cache.
+    Returns the reply length or 0 on a miss
+*/
+static int fwd_cache_lookup(dns_forwarder_t *fwd, const dns_fwd_key_t *key, char *buf)
+{
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < DNS_FWD_CACHE_SLOTS; i++) {
+        dns_fwd_cache_t *c = &fwd->cache[i];
+        if (c->key.len == 0 || !fwd_key_equal(&c->key, key)) {
+            continue;
+        }
+        if (c->expires_us <= now) {
+            c->key.len = 0;
+            return 0;
+        }
+        uint16_t id = ((dns_header_t *)buf)->id;
+        uint32_t age = (now - c->stored_us) / 1000000;
+        memcpy(buf, c->reply, c->len);
+        ((dns_header_t *)buf)->id = id;
+        fwd_for_each_ttl((uint8_t *)buf, c->len, fwd_ttl_age, &age);
+        c->last_used = ++fwd->lru_clock;
+        return c->len;
+    }
+    return 0;
+}
+
+// Sends a SERVFAIL carrying the question of key to every client waiting on p, then releases p
+static void fwd_pending_fail(dns_forwarder_t *fwd, dns_fwd_pending_t *p)
+{
+    char reply[sizeof(dns_header_t) + DNS_FWD_KEY_LEN];
+    dns_header_t *header = (dns_header_t *)reply;
+    memset(header, 0, sizeof(dns_header_t));
+    header->flags = htons(QR_FLAG | RD_FLAG | RA_FLAG | RCODE_SERVFAIL);
+    header->qd_count = htons(1);
+    // The key is the question plus the EDNS0 marker byte
+    memcpy(reply + sizeof(dns_header_t), p->key.data, p->key.len - 1);
+    size_t len = sizeof(dns_header_t) + p->key.len - 1;
+
+    for (int i = 0; i < p->num_waiters; i++) {
+        header->id = p->waiters[i].id;
+        sendto(p->waiters[i].sock, reply, len, 0, (struct sockaddr *)&p->waiters[i].addr, p->waiters[i].addr_len);
+    }
+    p->in_use = false;
+    fwd->num_pending--;
+}
+
+// Fails the upstream questions nobody answered in time, so the clients can retry right away
+static void fwd_expire_pending(dns_server_handle_t h)
+{
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < DNS_FWD_PENDING && h->fwd->num_pending; i++) {
+        dns_fwd_pending_t *p = &h->fwd->pending[i];
+        if (p->in_use && p->deadline_us <= now) {
+            h->stats.upstream_timeouts++;
+            fwd_pending_fail(h->fwd, p);
+        }
+    }
+}
+
+/*
+    Handles the request in h->rx_buffer, as dns_engine_parse() left it in query, if its question is covered by
+    a forwarding rule and there is an upstream resolver: answers it from the cache, joins an identical question
+    already in flight, or sends it upstream. Returns false if the request is to be answered locally
+*/
+static bool fwd_handle_request(void *arg, const struct sockaddr *source_addr, socklen_t addr_len,
+                               size_t len, const dns_engine_query_t *query)
+{
+    dns_server_handle_t h = arg;
+    dns_forwarder_t *fwd = h->fwd;
+    char *buf = h->rx_buffer;
+    dns_header_t *header = (dns_header_t *)buf;
+
+    if (fwd == NULL || fwd->upstream.addr == 0 || query->qd_count != 1) {
+        return false;
+    }
+    // The IPv6 socket is IPv6-only, the address family tells which socket the request came in on
+    int sock = source_addr->sa_family == AF_INET ? h->sock4 : h->sock6;
+    int rule = query->questions[0].rule;
+    if (rule < 0 || !h->entry[rule].forward) {
+        return false;
+    }
+    char *question_end = buf + query->questions_end;
+    int has_opt = query->has_opt;
+    dns_fwd_key_t key;
+    if (!fwd_key_build(buf, len, has_opt, &key)) {
+        return false;
+    }
+
+    int reply_len = fwd_cache_lookup(fwd, &key, buf);
+    if (reply_len > 0) {
+        h->stats.cache_hits++;
+        if (sendto(sock, buf, reply_len, 0, source_addr, addr_len) < 0) {
+            h->stats.errors++;
+        } else {
+            h->stats.answers++;
+        }
+        return true;
+    }
+    h->stats.cache_misses++;
+
+    dns_fwd_waiter_t waiter = {
+        .addr_len = addr_len, .sock = sock, .id = header->id
+    };
+    memcpy(&waiter.addr, source_addr, MIN(addr_len, sizeof(waiter.addr)));
+    dns_fwd_pending_t *free_slot = NULL;
+    for (int i = 0; i < DNS_FWD_PENDING; i++) {
+        dns_fwd_pending_t *p = &fwd->pending[i];
+        if (!p->in_use) {
+            free_slot = free_slot ? free_slot : p;
+        } else if (fwd_key_equal(&p->key, &key)) {
+            // Same question already on its way, just wait for that answer too
+            if (p->num_waiters < DNS_FWD_WAITERS) {
+                p->waiters[p->num_waiters++] = waiter;
+                h->stats.coalesced++;
+            } else {
+                h->stats.drops++;
             }
-            if (ip.addr == IPADDR_ANY) {    // no rule applies, continue with another question
-                continue;
+            return true;
+        }
+    }
+    if (free_slot == NULL) {
+        h->stats.drops++;
+        return true;
+    }
+
+    // Our own id towards the upstream, and no more than we can receive in one datagram
+    header->id = esp_random() & 0xFFFF;
+    if (has_opt) {
+        char *opt_ptr = question_end;
+        // The OPT record is usually the only additional record, find it again to clamp its payload size in place
+        for (int i = 0; i < ntohs(header->ns_count) + ntohs(header->ar_count); i++) {
+            char *rr_end = (char *)dns_engine_skip_name(opt_ptr, buf + len);
+            if (rr_end == NULL) {
+                break;
             }
-            dns_answer_t *answer = (dns_answer_t *)cur_ans_ptr;
+            dns_opt_t *rr = (dns_opt_t *)(rr_end - 1);
+            if (rr_end == opt_ptr + 1 && ntohs(rr->type) == QD_TYPE_OPT) {
+                rr->udp_payload_size = htons(MIN(ntohs(rr->udp_payload_size), DNS_EDNS_MAX_LEN));
+                break;
+            }
+            opt_ptr = rr_end + sizeof(dns_opt_t) - 1 + ntohs(rr->rdata_len);
+        }
+    }
+    struct sockaddr_in upstream = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = fwd->upstream.addr,
+    };
+    if (sendto(fwd->sock, buf, len, 0, (struct sockaddr *)&upstream, sizeof(upstream)) < 0) {
+        ESP_LOGD(TAG, "Failed to forward query: errno %d", errno);
+        h->stats.errors++;
+        // Fail the client right away rather than leaving it to time out
+        header->id = waiter.id;
+        header->flags = htons(QR_FLAG | RD_FLAG | RA_FLAG | RCODE_SERVFAIL);
+        header->an_count = 0;
+        header->ns_count = 0;
+        header->ar_count = 0;
+        sendto(sock, buf, query->questions_end, 0, source_addr, addr_len);
+        return true;
+    }
+
+    *free_slot = (dns_fwd_pending_t) {
+        .in_use = true,
+        .upstream_id = header->id,
+        .deadline_us = esp_timer_get_time() + DNS_FWD_TIMEOUT_US,
+        .key = key,
+        .num_waiters = 1,
+        .waiters = { waiter },
+    };
+    fwd->num_pending++;
+    h->stats.forwarded++;
+    return true;
+}
 
-            answer->ptr_offset = htons(0xC000 | (cur_qd_ptr - dns_reply));
-            answer->type = htons(qd_type);
-            answer->class = htons(qd_class);
-            answer->ttl = htonl(ANS_TTL_SEC);
+// Relays the upstream replies to the clients waiting for them and caches them
+static void fwd_drain_upstream(dns_server_handle_t h)
+{
+    dns_forwarder_t *fwd = h->fwd;
+    char *buf = h->rx_buffer;
 
-            ESP_LOGD(TAG, "Answer with PTR offset: 0x%" PRIX16 " and IP 0x%" PRIX32, ntohs(answer->ptr_offset), ip.addr);
+    for (int n = 0; n < DNS_DRAIN_BATCH; n++) {
+        struct sockaddr_in source_addr;
+        socklen_t socklen = sizeof(source_addr);
+        int len = recvfrom(fwd->sock, buf, sizeof(h->rx_buffer), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen);
+        if (len < 0) {
+            return;
+        }
+        // Anything not coming from the resolver we asked is spoofed or stale
+        if (len < sizeof(dns_header_t) || source_addr.sin_addr.s_addr != fwd->upstream.addr ||
+                source_addr.sin_port != htons(DNS_PORT)) {
+            h->stats.drops++;
+            continue;
+        }
+        dns_header_t *header = (dns_header_t *)buf;
+        dns_fwd_key_t key;
+        dns_fwd_pending_t *p = NULL;
+        for (int i = 0; i < DNS_FWD_PENDING; i++) {
+            if (fwd->pending[i].in_use && fwd->pending[i].upstream_id == header->id) {
+                p = &fwd->pending[i];
+                break;
+            }
+        }
+        // The question must match too, the 16-bit id alone is easy to guess
+        if (p == NULL || !fwd_key_build(buf, len, p->key.data[p->key.len - 1], &key) || !fwd_key_equal(&key, &p->key)) {
+            ESP_LOGD(TAG, "Dropping unexpected upstream reply");
+            h->stats.drops++;
+            continue;
+        }
 
-            answer->addr_len = htons(sizeof(ip.addr));
-            answer->ip_addr = ip.addr;
+        fwd_cache_store(fwd, &p->key, buf, len);
+        for (int i = 0; i < p->num_waiters; i++) {
+            header->id = p->waiters[i].id;
+            if (sendto(p->waiters[i].sock, buf, len, 0, (struct sockaddr *)&p->waiters[i].addr, p->waiters[i].addr_len) < 0) {
+                h->stats.errors++;
+            } else {
+                h->stats.answers++;
+            }
         }
+        p->in_use = false;
+        fwd->num_pending--;
     }
-    return reply_len;
 }
 
 /*
-    Sets up a socket and listen for DNS queries,
-    replies to all type A queries with the IP of the softAP
+    Answers every datagram already queued on the socket before going back to select(),
+    so a burst of probes from several clients is served in one wakeup
 */
-void dns_server_task(void *pvParameters)
+static void dns_server_drain(int sock, dns_server_handle_t h)
 {
-    char rx_buffer[128];
-    char addr_str[128];
-    int addr_family;
-    int ip_protocol;
-    dns_server_handle_t handle = pvParameters;
-
-    while (handle->started) {
+    for (int i = 0; i < DNS_DRAIN_BATCH && h->started; i++) {
+        struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+        socklen_t socklen = sizeof(source_addr);
+        int len = recvfrom(sock, h->rx_buffer, sizeof(h->rx_buffer), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                ESP_LOGD(TAG, "recvfrom failed: errno %d", errno);
+                h->stats.errors++;
+            }
+            return;
+        }
+        h->stats.queries++;
+        int64_t start_us = esp_timer_get_time();
 
-        struct sockaddr_in dest_addr;
-        dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        dest_addr.sin_family = AF_INET;
-        dest_addr.sin_port = htons(DNS_PORT);
-        addr_family = AF_INET;
-        ip_protocol = IPPROTO_IP;
-        inet_ntoa_r(dest_addr.sin_addr, addr_str, sizeof(addr_str) - 1);
-
-        int sock = socket(addr_family, SOCK_DGRAM, ip_protocol);
-        if (sock < 0) {
-            ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        int reply_len = 0;
+        dns_responder_verdict_t verdict = dns_responder_handle(&h->responder, h->rx_buffer, len, sizeof(h->rx_buffer),
+                                                               (struct sockaddr *)&source_addr, socklen, start_us, &reply_len);
+        switch (verdict) {
+        case DNS_RESPONDER_REPLY:
             break;
+        case DNS_RESPONDER_FORWARDED:
+            stats_record_latency(h, start_us);
+            continue;
+        case DNS_RESPONDER_DROP:
+            ESP_LOGD(TAG, "Dropping %d byte request", len);
+            h->stats.drops++;
+            continue;
+        case DNS_RESPONDER_RATE_LIMITED:
+        case DNS_RESPONDER_FLOOD_START:
+            rate_limit_record(h, verdict == DNS_RESPONDER_FLOOD_START);
+            continue;
         }
-        ESP_LOGI(TAG, "Socket created");
+        if (sendto(sock, h->rx_buffer, reply_len, 0, (struct sockaddr *)&source_addr, socklen) < 0) {
+            ESP_LOGD(TAG, "Error occurred during sending: errno %d", errno);
+            h->stats.errors++;
+            continue;
+        }
+        h->stats.answers++;
+        stats_record_latency(h, start_us);
+    }
+}
+
+static void tcp_conn_close(dns_tcp_conn_t *conn)
+{
+    close(conn->sock);
+    conn->sock = -1;
+}
 
-        int err = bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
-        if (err < 0) {
-            ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+// Takes a new TCP connection if a slot is free, otherwise turns it away right away
+static void tcp_accept(dns_server_handle_t h)
+{
+    struct sockaddr_in6 peer;
+    socklen_t peer_len = sizeof(peer);
+    int sock = accept(h->tcp_listen, (struct sockaddr *)&peer, &peer_len);
+    if (sock < 0) {
+        return;
+    }
+    for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+        dns_tcp_conn_t *conn = &h->tcp[i];
+        if (conn->sock < 0) {
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+            conn->sock = sock;
+            conn->len = 0;
+            conn->peer = peer;
+            conn->last_us = esp_timer_get_time();
+            return;
         }
-        ESP_LOGI(TAG, "Socket bound, port %d", DNS_PORT);
+    }
+    h->stats.drops++;
+    close(sock);
+}
 
-        while (handle->started) {
-            ESP_LOGI(TAG, "Waiting for data");
-            struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
-            socklen_t socklen = sizeof(source_addr);
-            int len = recvfrom(sock, rx_buffer, sizeof(rx_buffer) - 1, 0, (struct sockaddr *)&source_addr, &socklen);
+/*
+    Reads from a TCP connection and answers every complete message buffered so far with the same engine as UDP.
+    The connection is closed on EOF, errors, oversized messages or a reply that does not go out in one send
+*/
+static void tcp_receive(dns_server_handle_t h, dns_tcp_conn_t *conn)
+{
+    int len = recv(conn->sock, conn->buf + conn->len, sizeof(conn->buf) - conn->len, MSG_DONTWAIT);
+    if (len <= 0) {
+        if (len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            tcp_conn_close(conn);
+        }
+        return;
+    }
+    conn->len += len;
+    conn->last_us = esp_timer_get_time();
 
-            // Error occurred during receiving
-            if (len < 0) {
-                ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
-                close(sock);
-                break;
+    while (conn->len >= 2) {
+        size_t msg_len = (uint8_t)conn->buf[0] << 8 | (uint8_t)conn->buf[1];
+        if (msg_len > DNS_TCP_MAX_LEN) {
+            h->stats.drops++;
+            tcp_conn_close(conn);
+            return;
+        }
+        if (conn->len < 2 + msg_len) {
+            return;
+        }
+        h->stats.queries++;
+        h->stats.tcp_queries++;
+        int64_t start_us = conn->last_us;
+
+        // Answered in the task's receive buffer, anything pipelined behind this message stays where it is
+        memcpy(h->rx_buffer, conn->buf + 2, msg_len);
+        int reply_len = -1;
+        dns_rate_verdict_t rate = dns_responder_charge(&h->responder, (struct sockaddr *)&conn->peer, esp_timer_get_time());
+        if (rate == DNS_RATE_ALLOW) {
+            reply_len = dns_engine_answer(&h->engine, h->rx_buffer, msg_len, sizeof(h->rx_buffer), true);
+        } else {
+            rate_limit_record(h, rate == DNS_RATE_DROP_FLOOD_START);
+        }
+        if (reply_len <= 0) {
+            h->stats.drops++;
+            tcp_conn_close(conn);
+            return;
+        }
+        uint8_t prefix[2] = { reply_len >> 8, reply_len & 0xff };
+        if (send(conn->sock, prefix, sizeof(prefix), MSG_DONTWAIT | MSG_MORE) != sizeof(prefix) ||
+            send(conn->sock, h->rx_buffer, reply_len, MSG_DONTWAIT) != reply_len) {
+            h->stats.errors++;
+            tcp_conn_close(conn);
+            return;
+        }
+        h->stats.answers++;
+        stats_record_latency(h, start_us);
+
+        conn->len -= 2 + msg_len;
+        memmove(conn->buf, conn->buf + 2 + msg_len, conn->len);
+    }
+}
+
+// Closes TCP connections idle for too long, clients reconnect if they need to
+static void tcp_expire(dns_server_handle_t h)
+{
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+        if (h->tcp[i].sock >= 0 && now - h->tcp[i].last_us > DNS_TCP_IDLE_TIMEOUT_US) {
+            tcp_conn_close(&h->tcp[i]);
+        }
+    }
+}
+
+/*
+    Waits on the UDP, TCP and control sockets and answers DNS queries
+    until stop_dns_server() pokes the control socket
+*/
+static void dns_server_task(void *pvParameters)
+{
+    dns_server_handle_t handle = pvParameters;
+
+    while (handle->started) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(handle->ctrl_sock, &read_fds);
+        FD_SET(handle->sock4, &read_fds);
+        int max_fd = MAX(MAX(handle->sock4, handle->sock6), MAX(handle->ctrl_sock, handle->tcp_listen));
+        if (handle->sock6 >= 0) {
+            FD_SET(handle->sock6, &read_fds);
+        }
+        if (handle->tcp_listen >= 0) {
+            FD_SET(handle->tcp_listen, &read_fds);
+        }
+        for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+            if (handle->tcp[i].sock >= 0) {
+                FD_SET(handle->tcp[i].sock, &read_fds);
+                max_fd = MAX(max_fd, handle->tcp[i].sock);
             }
-            // Data received
-            else {
-                // Get the sender's ip address as string
-                if (source_addr.sin6_family == PF_INET) {
-                    inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr.s_addr, addr_str, sizeof(addr_str) - 1);
-                } else if (source_addr.sin6_family == PF_INET6) {
-                    inet6_ntoa_r(source_addr.sin6_addr, addr_str, sizeof(addr_str) - 1);
-                }
-
-                // Null-terminate whatever we received and treat like a string...
-                rx_buffer[len] = 0;
-
-                char reply[DNS_MAX_LEN];
-                int reply_len = parse_dns_request(rx_buffer, len, reply, DNS_MAX_LEN, handle);
-
-                ESP_LOGI(TAG, "Received %d bytes from %s | DNS reply with len: %d", len, addr_str, reply_len);
-                if (reply_len <= 0) {
-                    ESP_LOGE(TAG, "Failed to prepare a DNS reply");
-                } else {
-                    int err = sendto(sock, reply, reply_len, 0, (struct sockaddr *)&source_addr, sizeof(source_addr));
-                    if (err < 0) {
-                        ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
-                        break;
-                    }
-                }
+        }
+        // The timeout only matters if the wake-up datagram got lost, e.g. without a loopback netif,
+        // or while forwarded questions may need to be timed out
+        struct timeval timeout = { .tv_sec = DNS_SELECT_TIMEOUT_SEC };
+        if (handle->fwd) {
+            FD_SET(handle->fwd->sock, &read_fds);
+            max_fd = MAX(max_fd, handle->fwd->sock);
+            if (handle->fwd->num_pending) {
+                timeout = (struct timeval) { .tv_usec = DNS_FWD_POLL_MS * 1000 };
             }
         }
+        int ready = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+        if (ready < 0) {
+            ESP_LOGE(TAG, "select failed: errno %d", errno);
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        if (FD_ISSET(handle->ctrl_sock, &read_fds)) {
+            break;
+        }
 
-        if (sock != -1) {
-            ESP_LOGE(TAG, "Shutting down socket");
-            shutdown(sock, 0);
-            close(sock);
+        if (FD_ISSET(handle->sock4, &read_fds)) {
+            dns_server_drain(handle->sock4, handle);
+        }
+        if (handle->sock6 >= 0 && FD_ISSET(handle->sock6, &read_fds)) {
+            dns_server_drain(handle->sock6, handle);
         }
+        if (handle->fwd) {
+            if (FD_ISSET(handle->fwd->sock, &read_fds)) {
+                fwd_drain_upstream(handle);
+            }
+            fwd_expire_pending(handle);
+        }
+        for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+            if (handle->tcp[i].sock >= 0 && FD_ISSET(handle->tcp[i].sock, &read_fds)) {
+                tcp_receive(handle, &handle->tcp[i]);
+            }
+        }
+        if (handle->tcp_listen >= 0 && FD_ISSET(handle->tcp_listen, &read_fds)) {
+            tcp_accept(handle);
+        }
+        tcp_expire(handle);
+        stats_publish(handle);
     }
+
+    ESP_LOGI(TAG, "Stopped (queries %" PRIu32 ", answers %" PRIu32 ", dropped %" PRIu32 ", rate limited %" PRIu32 ", errors %" PRIu32 ")",
+             handle->stats.queries, handle->stats.answers, handle->stats.drops, handle->stats.rate_limited, handle->stats.errors);
+    if (handle->fwd) {
+        ESP_LOGI(TAG, "Forwarded %" PRIu32 ", coalesced %" PRIu32 ", cache hits %" PRIu32 " / misses %" PRIu32 ", upstream timeouts %" PRIu32,
+                 handle->stats.forwarded, handle->stats.coalesced, handle->stats.cache_hits,
+                 handle->stats.cache_misses, handle->stats.upstream_timeouts);
+    }
+    // Sockets are closed by stop_dns_server(), once it knows this task no longer uses them
+    xSemaphoreGive(handle->stopped);
     vTaskDelete(NULL);
 }
 
+static int open_udp_socket(int family, const struct sockaddr *addr, socklen_t addr_len)
+{
+    int sock = socket(family, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+        return -1;
+    }
+#if CONFIG_LWIP_IPV6
+    if (family == AF_INET6) {
+        int v6only = 1;
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+    }
+#endif
+    if (bind(sock, addr, addr_len) < 0) {
+        ESP_LOGE(TAG, "Socket unable to bind: errno %d", errno);
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static void close_sockets(dns_server_handle_t handle)
+{
+    int unused = -1;
+    int *socks[] = { &handle->sock4, &handle->sock6, &handle->ctrl_sock, &handle->tcp_listen,
+                     handle->fwd ? &handle->fwd->sock : &unused
+                   };
+    for (int i = 0; i < sizeof(socks) / sizeof(socks[0]); i++) {
+        if (*socks[i] >= 0) {
+            close(*socks[i]);
+            *socks[i] = -1;
+        }
+    }
+    for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+        if (handle->tcp[i].sock >= 0) {
+            tcp_conn_close(&handle->tcp[i]);
+        }
+    }
+}
+
+static esp_err_t open_sockets(dns_server_handle_t handle)
+{
+    struct sockaddr_in addr4 = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    handle->sock4 = open_udp_socket(AF_INET, (struct sockaddr *)&addr4, sizeof(addr4));
+    ESP_RETURN_ON_FALSE(handle->sock4 >= 0, ESP_FAIL, TAG, "Failed to open IPv4 socket");
+
+#if CONFIG_LWIP_IPV6
+    struct sockaddr_in6 addr6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(DNS_PORT),
+    };
+    handle->sock6 = open_udp_socket(AF_INET6, (struct sockaddr *)&addr6, sizeof(addr6));
+    if (handle->sock6 < 0) {
+        ESP_LOGW(TAG, "Serving IPv4 only");
+    }
+#endif
+
+    // Bound to an ephemeral loopback port, stop_dns_server() sends itself a datagram there to wake the task
+    handle->ctrl_addr = (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    handle->ctrl_sock = open_udp_socket(AF_INET, (struct sockaddr *)&handle->ctrl_addr, sizeof(handle->ctrl_addr));
+    ESP_RETURN_ON_FALSE(handle->ctrl_sock >= 0, ESP_FAIL, TAG, "Failed to open control socket");
+    socklen_t len = sizeof(handle->ctrl_addr);
+    getsockname(handle->ctrl_sock, (struct sockaddr *)&handle->ctrl_addr, &len);
+
+    if (handle->fwd) {
+        struct sockaddr_in any = {
+            .sin_family = AF_INET,
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        handle->fwd->sock = open_udp_socket(AF_INET, (struct sockaddr *)&any, sizeof(any));
+        ESP_RETURN_ON_FALSE(handle->fwd->sock >= 0, ESP_FAIL, TAG, "Failed to open upstream socket");
+    }
+
+    // TCP is only a fallback for truncated answers, the server keeps working without it
+    handle->tcp_listen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (handle->tcp_listen >= 0) {
+        int reuse = 1;
+        setsockopt(handle->tcp_listen, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        fcntl(handle->tcp_listen, F_SETFL, fcntl(handle->tcp_listen, F_GETFL, 0) | O_NONBLOCK);
+        if (bind(handle->tcp_listen, (struct sockaddr *)&addr4, sizeof(addr4)) < 0 || listen(handle->tcp_listen, 1) < 0) {
+            ESP_LOGW(TAG, "TCP listener unavailable: errno %d", errno);
+            close(handle->tcp_listen);
+            handle->tcp_listen = -1;
+        }
+    }
+
+    ESP_LOGI(TAG, "Listening on port %d", DNS_PORT);
+    return ESP_OK;
+}
+
 dns_server_handle_t start_dns_server(dns_server_config_t *config)
 {
-    dns_server_handle_t handle = calloc(1, sizeof(struct dns_server_handle) + config->num_of_entries * sizeof(dns_entry_pair_t));
+    const dns_entry_pair_t *entries = config->entries ? config->entries : config->item;
+    ESP_RETURN_ON_FALSE(config->num_of_entries >= 0 && config->num_of_entries < UINT16_MAX, NULL, TAG, "Invalid number of entries");
+
+    size_t entries_size = config->num_of_entries * sizeof(dns_entry_pair_t);
+    size_t rules_size = config->num_of_entries * sizeof(dns_engine_rule_t);
+    size_t index_size = dns_engine_index_slots(config->num_of_entries) * sizeof(dns_rule_slot_t);
+    dns_server_handle_t handle = calloc(1, sizeof(struct dns_server_handle) + entries_size + rules_size + index_size);
     ESP_RETURN_ON_FALSE(handle, NULL, TAG, "Failed to allocate dns server handle");
 
+    handle->sock4 = handle->sock6 = handle->ctrl_sock = handle->tcp_listen = -1;
+    for (int i = 0; i < DNS_TCP_MAX_CONNS; i++) {
+        handle->tcp[i].sock = -1;
+    }
+    for (int i = 0; i < config->num_of_entries && config->upstream_if_key; i++) {
+        if (entries[i].forward) {
+            handle->fwd = calloc(1, sizeof(dns_forwarder_t));
+            if (handle->fwd == NULL) {
+                ESP_LOGE(TAG, "Failed to allocate the forwarder");
+                goto err;
+            }
+            handle->fwd->sock = -1;
+            handle->upstream_if_key = config->upstream_if_key;
+            break;
+        }
+    }
+    handle->stopped = xSemaphoreCreateBinary();
+    if (handle->stopped == NULL || open_sockets(handle) != ESP_OK) {
+        goto err;
+    }
+
     handle->started = true;
     handle->num_of_entries = config->num_of_entries;
-    memcpy(handle->entry, config->item, config->num_of_entries * sizeof(dns_entry_pair_t));
+    memcpy(handle->entry, entries, entries_size);
+    handle->answer_aaaa = config->answer_aaaa;
+    handle->rules = (dns_engine_rule_t *)((char *)handle->entry + entries_size);
+    for (int i = 0; i < handle->num_of_entries; i++) {
+        handle->rules[i].name = handle->entry[i].name;
+        handle->rules[i].forward = handle->entry[i].forward;
+    }
+    dns_engine_init(&handle->engine, handle->rules, handle->num_of_entries, (dns_rule_slot_t *)((char *)handle->rules + rules_size));
+    answer_ip_refresh(handle);
+
+    dns_rate_limit_init(&handle->rate_limit, config->rate_limit_qps ? config->rate_limit_qps : DNS_RATE_LIMIT_QPS,
+                        config->rate_limit_burst ? config->rate_limit_burst : DNS_RATE_LIMIT_BURST);
+    handle->responder = (dns_responder_t) {
+        .engine = &handle->engine,
+        .rate_limit = &handle->rate_limit,
+        .forward = handle->fwd ? fwd_handle_request : NULL,
+        .forward_arg = handle,
+    };
+
+    if (xTaskCreate(dns_server_task, "dns_server", 4096, handle, 5, &handle->task) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create dns server task");
+        goto err;
+    }
 
-    xTaskCreate(dns_server_task, "dns_server", 4096, handle, 5, &handle->task);
+    if (esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID, answer_ip_event_handler, handle, &handle->ip_event) != ESP_OK ||
+            esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_AP_START, answer_ip_event_handler, handle, &handle->ap_event) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to register address events, answers will not follow interface changes");
+    }
     return handle;
+
+err:
+    close_sockets(handle);
+    if (handle->stopped) {
+        vSemaphoreDelete(handle->stopped);
+    }
+    free(handle->fwd);
+    free(handle);
+    return NULL;
+}
+
+esp_err_t dns_server_get_stats(dns_server_handle_t handle, dns_server_stats_t *stats)
+{
+    ESP_RETURN_ON_FALSE(handle && stats, ESP_ERR_INVALID_ARG, TAG, "Invalid arguments");
+
+    for (int retry = 0; retry < DNS_STATS_READ_RETRIES; retry++) {
+        uint32_t seq = handle->stats_seq;
+        atomic_thread_fence(memory_order_acquire);
+        if ((seq & 1) == 0) {
+            memcpy(stats, &handle->published, sizeof(dns_server_stats_t));
+            atomic_thread_fence(memory_order_acquire);
+            if (handle->stats_seq == seq) {
+                return ESP_OK;
+            }
+        }
+        // The task is copying the counters out, give it the CPU to finish
+        vTaskDelay(1);
+    }
+    return ESP_ERR_TIMEOUT;
 }
 
 void stop_dns_server(dns_server_handle_t handle)
 {
     if (handle) {
+        if (handle->ip_event) {
+            esp_event_handler_instance_unregister(IP_EVENT, ESP_EVENT_ANY_ID, handle->ip_event);
+        }
+        if (handle->ap_event) {
+            esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_AP_START, handle->ap_event);
+        }
+
         handle->started = false;
-        vTaskDelete(handle->task);
+        char wake = 0;
+        sendto(handle->ctrl_sock, &wake, sizeof(wake), 0, (struct sockaddr *)&handle->ctrl_addr, sizeof(handle->ctrl_addr));
+        if (xSemaphoreTake(handle->stopped, pdMS_TO_TICKS((DNS_SELECT_TIMEOUT_SEC + 1) * 1000)) != pdTRUE) {
+            // Should never happen, but a stuck task must not keep using the sockets closed below
+            ESP_LOGW(TAG, "Server task did not stop in time, deleting it");
+            vTaskDelete(handle->task);
+        }
+
+        close_sockets(handle);
+        vSemaphoreDelete(handle->stopped);
+        free(handle->fwd);
         free(handle);
     }
 }
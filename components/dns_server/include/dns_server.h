@@ -6,6 +6,10 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +18,12 @@ extern "C" {
 #define DNS_SERVER_MAX_ITEMS 1
 #endif
 
+/**
+ * @brief Number of LWIP sockets a running DNS server holds at most: UDP over IPv4 and IPv6, a control socket,
+ * the upstream socket in forwarding mode, and the TCP listener with up to two connections
+ */
+#define DNS_SERVER_MAX_SOCKETS 7
+
 #define DNS_SERVER_CONFIG_SINGLE(queried_name, netif_key)  {        \
         .num_of_entries = 1,                                        \
         .item = { { .name = queried_name, .if_key = netif_key } }   \
@@ -24,11 +34,13 @@ extern "C" {
  *
  * @note Please use string literals (or ensure they are valid during dns_server lifetime) as names, since
  * we don't take copies of the config values `name` and `if_key`
+ * @note The address of `if_key` is looked up once and refreshed on IP_EVENT and WIFI_EVENT_AP_START events only
  */
 typedef struct dns_entry_pair {
-    const char* name;       /**<! Exact match of the name field of the DNS query to answer */
+    const char* name;       /**<! Name to answer: exact (case-insensitive) name, "*.suffix" for any name below suffix, or "*" for all */
     const char* if_key;     /**<! Use this network interface IP to answer, only if NULL, use the static IP below */
     esp_ip4_addr_t ip;      /**<! Constant IP address to answer this query, if "if_key==NULL" */
+    bool forward;           /**<! Forward matching queries to the upstream resolver, answer as above only while there is none */
 } dns_entry_pair_t;
 
 /**
@@ -46,10 +58,19 @@ typedef struct dns_entry_pair {
  *             {.name = "my-utils.com", .ip = { .addr = ESP_IP4TOADDR( 192, 168, 4, 100) } } } };
  * start_dns_server(&config);
  * \endcode
+ *
+ * Larger rule sets can be kept in a separate table and passed by `entries`, the rules are compiled
+ * into a hash index when the server starts. A query is answered by the exact rule for its name,
+ * otherwise by the longest matching "*.suffix" rule, otherwise by "*".
  */
 typedef struct dns_server_config {
     int num_of_entries;                             /**<! Number of rules specified in the config struct */
     dns_entry_pair_t item[DNS_SERVER_MAX_ITEMS];    /**<! Array of pairs */
+    const dns_entry_pair_t *entries;                /**<! Optional table of `num_of_entries` pairs used instead of `item` */
+    bool answer_aaaa;                               /**<! Answer AAAA queries of `if_key` rules with the netif's IPv6 link-local address */
+    uint16_t rate_limit_qps;                        /**<! Sustained queries per second accepted from one client address, 0 for the default (20) */
+    uint16_t rate_limit_burst;                      /**<! Queries one client address may send in a burst, 0 for the default (40) */
+    const char *upstream_if_key;                    /**<! Netif whose (IPv4) DNS server `forward` rules use, e.g. "WIFI_STA_DEF" */
 } dns_server_config_t;
 
 /**
@@ -57,17 +78,83 @@ typedef struct dns_server_config {
  */
 typedef struct dns_server_handle *dns_server_handle_t;
 
+#define DNS_SERVER_TOP_NAMES 8          /**<! Number of most queried names tracked */
+#define DNS_SERVER_TOP_NAME_LEN 64      /**<! Longer names are tracked by their first 63 characters */
+#define DNS_SERVER_LATENCY_BUCKETS 8    /**<! Service time histogram buckets */
+/**
+ * @brief Upper bounds (exclusive, in microseconds) of all but the last service time bucket
+ */
+#define DNS_SERVER_LATENCY_BOUNDS_US { 50, 100, 200, 500, 1000, 2000, 5000 }
+
+/**
+ * @brief Query count of one of the most queried names
+ */
+typedef struct {
+    char name[DNS_SERVER_TOP_NAME_LEN];
+    uint32_t count;             /**<! Upper bound, may include counts inherited from a name it replaced */
+} dns_server_name_stat_t;
+
+/**
+ * @brief Snapshot of the DNS server statistics, all counters since the server started
+ */
+typedef struct {
+    uint32_t queries;           /**<! Requests received */
+    uint32_t answers;           /**<! Replies sent, including error replies */
+    uint32_t tcp_queries;       /**<! Requests received over TCP, also counted in `queries` */
+    uint32_t drops;             /**<! Requests not answered at all */
+    uint32_t parse_failures;    /**<! Requests answered with FORMERR */
+    uint32_t rate_limited;      /**<! Requests dropped by the per-client rate limit */
+    uint32_t errors;            /**<! Socket errors */
+    uint32_t type_a;            /**<! Questions by type */
+    uint32_t type_aaaa;
+    uint32_t type_https;
+    uint32_t type_other;
+    uint32_t forwarded;         /**<! Questions sent to the upstream resolver */
+    uint32_t coalesced;         /**<! Questions that joined an identical one in flight */
+    uint32_t cache_hits;        /**<! Forwarded questions answered from the cache */
+    uint32_t cache_misses;
+    uint32_t upstream_timeouts;
+    uint32_t latency_hist[DNS_SERVER_LATENCY_BUCKETS];  /**<! Service time histogram, see DNS_SERVER_LATENCY_BOUNDS_US */
+    dns_server_name_stat_t top_names[DNS_SERVER_TOP_NAMES];  /**<! Most queried names, unordered, unused ones have count 0 */
+} dns_server_stats_t;
+
 /**
  * @brief Set ups and starts a simple DNS server that will respond to all A queries (IPv4)
  * based on configured rules, pairs of name and either IPv4 address or a netif ID (to respond by it's IPv4 add)
  *
+ * Queries are accepted on UDP port 53 over IPv4 and, if LWIP has IPv6 enabled, over IPv6.
+ * Clients getting a truncated (TC) reply can retry over TCP port 53 (IPv4); forwarded names are served over UDP only.
+ *
+ * Rules marked `forward` are relayed to the DNS server of `upstream_if_key` once that netif has one,
+ * e.g. to give softAP clients internet access while the STA uplink is up. Upstream replies are cached
+ * until their smallest TTL expires, and identical questions in flight share one upstream query.
+ *
+ * Other query types for a name covered by a rule get an empty (NODATA) answer, names no rule covers get NXDOMAIN,
+ * so clients never have to wait for a timeout.
+ *
  * @param config Configuration structure listing the pairs of (name, IP/netif-id)
  * @return dns_server's handle on success, NULL on failure
  */
 dns_server_handle_t start_dns_server(dns_server_config_t *config);
 
+/**
+ * @brief Copies a consistent snapshot of the server statistics
+ *
+ * Never blocks the server task, safe to call from any task while the server runs. The counters are
+ * published after every batch of requests the server task handles.
+ *
+ * @param handle DNS server's handle
+ * @param[out] stats Statistics snapshot
+ * @return ESP_OK on success, ESP_ERR_TIMEOUT if no consistent snapshot could be taken
+ */
+esp_err_t dns_server_get_stats(dns_server_handle_t handle, dns_server_stats_t *stats);
+
 /**
  * @brief Stops and destroys DNS server's task and structs
+ *
+ * The task is woken up and exits on its own, all its sockets are closed before this returns,
+ * so the server can be started again right away.
+ *
  * @param handle DNS server's handle to destroy
  */
 void stop_dns_server(dns_server_handle_t handle);
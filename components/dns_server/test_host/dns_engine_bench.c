@@ -0,0 +1,60 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Microbenchmark of the engine: answers every corpus query over and over and reports ns/query,
+    per query and overall. Includes copying the request into the buffer, as the server does
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host_engine.h"
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <corpus dir> [iterations]\n", argv[0]);
+        return 2;
+    }
+    long iterations = argc > 2 ? atol(argv[2]) : 100000;
+    host_query_t *queries;
+    int count = host_corpus_load(argv[1], &queries);
+    if (count <= 0) {
+        fprintf(stderr, "No corpus in %s\n", argv[1]);
+        return 1;
+    }
+
+    dns_engine_t engine;
+    host_engine_init(&engine);
+    char buf[DNS_EDNS_MAX_LEN];
+    int64_t total_ns = 0;
+    long total = 0;
+    printf("%-40s %10s\n", "query", "ns/query");
+    for (int i = 0; i < count; i++) {
+        int64_t start = now_ns();
+        for (long n = 0; n < iterations; n++) {
+            memcpy(buf, queries[i].data, queries[i].len);
+            dns_engine_answer(&engine, buf, queries[i].len, sizeof(buf), false);
+        }
+        int64_t elapsed = now_ns() - start;
+        printf("%-40s %10.1f\n", queries[i].name, (double)elapsed / iterations);
+        total_ns += elapsed;
+        total += iterations;
+    }
+    printf("%-40s %10.1f\n", "all", (double)total_ns / total);
+    host_corpus_free(queries, count);
+    return 0;
+}
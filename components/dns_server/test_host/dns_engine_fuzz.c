@@ -0,0 +1,64 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Fuzz target for the engine: every input is answered as a UDP and as a TCP request, and its name
+    parsing is run on its own from every offset. Exact-size heap copies let the sanitizers catch any
+    access outside the message. Built with libFuzzer (DNS_ENGINE_LIBFUZZER) or with fuzz_replay.c
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_engine.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static void answer(dns_engine_t *engine, const uint8_t *data, size_t size, size_t buf_len, bool over_tcp)
+{
+    if (size > buf_len) {
+        return;
+    }
+    char *buf = malloc(buf_len);
+    memcpy(buf, data, size);
+    int reply_len = dns_engine_answer(engine, buf, size, buf_len, over_tcp);
+    if (reply_len > (int)buf_len || (reply_len >= 0 && reply_len < (int)sizeof(dns_header_t))) {
+        abort();
+    }
+    free(buf);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static dns_engine_t engine;
+    static bool initialized;
+    if (!initialized) {
+        host_engine_init(&engine);
+        initialized = true;
+    }
+    // Either way of handling the forwarded rule
+    engine.forwarding = size & 1;
+
+    answer(&engine, data, size, DNS_EDNS_MAX_LEN, false);
+    answer(&engine, data, size, DNS_EDNS_MAX_LEN, true);
+
+    char *msg = malloc(size ? size : 1);
+    memcpy(msg, data, size);
+    for (size_t offset = 0; offset < size; offset++) {
+        char name[DNS_MAX_NAME_LEN + 1];
+        const char *end = dns_engine_parse_name(msg, msg + offset, msg + size, name, sizeof(name));
+        if (end && (end <= msg + offset || end > msg + size || strlen(name) >= sizeof(name))) {
+            abort();
+        }
+        const char *skipped = dns_engine_skip_name(msg + offset, msg + size);
+        if (skipped && (skipped <= msg + offset || skipped > msg + size)) {
+            abort();
+        }
+    }
+    free(msg);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Synthetic flooder against the per-source token buckets, on a simulated clock: one source, or a
+    spoofer cycling through more sources than the table holds, floods while the phones around it keep
+    probing, and only the flooder may lose queries
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "dns_rate_limit.h"
+
+// Defaults of dns_server.c
+#define QPS (20)
+#define BURST (40)
+
+#define LEGIT_CLIENTS (8)
+#define FLOOD_INTERVAL_US (500)     // 2000 queries per second
+#define FLOOD_US (5 * 1000 * 1000)
+
+static int s_failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL line %d: ", __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+        } \
+    } while (0)
+
+static void ip4(uint8_t addr[16], int last)
+{
+    memset(addr, 0, 16);
+    addr[0] = 192;
+    addr[1] = 168;
+    addr[2] = 4;
+    addr[3] = last;
+}
+
+/*
+    Every phone opens with a burst of BURST / 2 probes and then asks 5 times a second,
+    the flooder sends as fast as FLOOD_INTERVAL_US allows
+*/
+static void test_flood(void)
+{
+    dns_rate_limit_t limit;
+    dns_rate_limit_init(&limit, QPS, BURST);
+    uint8_t flooder[16], phone[16];
+    ip4(flooder, 66);
+    int flood_allowed = 0, flood_starts = 0, legit_dropped = 0;
+
+    for (int64_t now = 0; now < FLOOD_US; now += FLOOD_INTERVAL_US) {
+        dns_rate_verdict_t verdict = dns_rate_limit_charge(&limit, AF_INET, flooder, now);
+        flood_allowed += verdict == DNS_RATE_ALLOW;
+        flood_starts += verdict == DNS_RATE_DROP_FLOOD_START;
+
+        for (int c = 0; c < LEGIT_CLIENTS; c++) {
+            int queries = now == 0 ? BURST / 2 : (now % 200000 == 0);
+            ip4(phone, 100 + c);
+            for (int q = 0; q < queries; q++) {
+                legit_dropped += dns_rate_limit_charge(&limit, AF_INET, phone, now) != DNS_RATE_ALLOW;
+            }
+        }
+    }
+
+    int64_t max_allowed = BURST + (int64_t)QPS * FLOOD_US / 1000000 + 1;
+    CHECK(legit_dropped == 0, "%d queries of the phones dropped", legit_dropped);
+    CHECK(flood_allowed >= BURST && flood_allowed <= max_allowed, "flooder got %d queries through, at most %d expected",
+          flood_allowed, (int)max_allowed);
+    CHECK(flood_starts == 1, "flood start reported %d times", flood_starts);
+    printf("flood      %d of %d flooder queries allowed, %d phone queries dropped\n",
+           flood_allowed, FLOOD_US / FLOOD_INTERVAL_US, legit_dropped);
+
+    // Once it calms down the flooder is an ordinary client again, a new flood is reported again
+    int64_t later = FLOOD_US + 2 * 1000 * 1000;
+    CHECK(dns_rate_limit_charge(&limit, AF_INET, flooder, later) == DNS_RATE_ALLOW, "flooder still limited after a pause");
+    for (int i = 1; i < BURST; i++) {
+        dns_rate_limit_charge(&limit, AF_INET, flooder, later);
+    }
+    CHECK(dns_rate_limit_charge(&limit, AF_INET, flooder, later) == DNS_RATE_DROP_FLOOD_START, "second flood not reported");
+    CHECK(dns_rate_limit_charge(&limit, AF_INET, flooder, later) == DNS_RATE_DROP, "second flood reported twice");
+}
+
+// Sources only match in the same family, 192.168.4.1 and the IPv6 address ::c0a8:401 are two clients
+static void test_families(void)
+{
+    dns_rate_limit_t limit;
+    dns_rate_limit_init(&limit, QPS, 1);
+    uint8_t addr[16];
+    ip4(addr, 1);
+    CHECK(dns_rate_limit_charge(&limit, AF_INET, addr, 0) == DNS_RATE_ALLOW, "first IPv4 query limited");
+    CHECK(dns_rate_limit_charge(&limit, AF_INET6, addr, 0) == DNS_RATE_ALLOW, "IPv6 query charged to the IPv4 source");
+    CHECK(dns_rate_limit_charge(&limit, AF_INET, addr, 0) == DNS_RATE_DROP_FLOOD_START, "second IPv4 query allowed");
+}
+
+/*
+    A flooder rotating through more addresses than the table holds keeps taking over slots. Those
+    newcomers share the overflow bucket, so the flood as a whole stays limited, and they only push out
+    each other: the phone keeps its slot and loses nothing
+*/
+static void test_table_churn(void)
+{
+    dns_rate_limit_t limit;
+    dns_rate_limit_init(&limit, QPS, BURST);
+    uint8_t addr[16];
+    int spoof_allowed = 0, spoof_starts = 0, legit_dropped = 0;
+    for (int64_t now = 0; now < FLOOD_US; now += FLOOD_INTERVAL_US) {
+        ip4(addr, 1 + (now / FLOOD_INTERVAL_US) % (4 * DNS_RATE_LIMIT_SLOTS));
+        dns_rate_verdict_t verdict = dns_rate_limit_charge(&limit, AF_INET, addr, now);
+        spoof_allowed += verdict == DNS_RATE_ALLOW;
+        spoof_starts += verdict == DNS_RATE_DROP_FLOOD_START;
+        if (now % 200000 == 0) {
+            ip4(addr, 200);
+            legit_dropped += dns_rate_limit_charge(&limit, AF_INET, addr, now) != DNS_RATE_ALLOW;
+        }
+    }
+
+    // The free slots' first buckets, the overflow bucket and the refill of both
+    int64_t max_allowed = (DNS_RATE_LIMIT_SLOTS + 1) * (BURST + (int64_t)QPS * FLOOD_US / 1000000 + 1);
+    CHECK(legit_dropped == 0, "%d phone queries dropped under a spoofed flood", legit_dropped);
+    CHECK(spoof_allowed <= max_allowed, "spoofed flood got %d queries through, at most %d expected",
+          spoof_allowed, (int)max_allowed);
+    CHECK(spoof_starts <= DNS_RATE_LIMIT_SLOTS + 1, "spoofed flood reported %d times", spoof_starts);
+    printf("churn      %d of %d spoofed queries allowed, reported %d times, %d phone queries dropped\n",
+           spoof_allowed, FLOOD_US / FLOOD_INTERVAL_US, spoof_starts, legit_dropped);
+}
+
+int main(void)
+{
+    test_flood();
+    test_families();
+    test_table_churn();
+    return s_failures ? 1 : 0;
+}
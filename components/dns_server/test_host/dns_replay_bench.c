@@ -0,0 +1,192 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Replay benchmark of the responder loop: several clients, like phones joining the softAP together,
+    fire their probe queries back to back at host_udp_server over loopback. Reports queries per second
+    and the latency percentiles of the burst, unanswered queries count as lost after a second.
+
+    Every datagram takes dns_responder_handle(), the path dns_server_task() runs: rate limiter, parse,
+    forwarder check and answer. What differs from the device: the limiter is set high enough never to drop
+    the shared 127.0.0.1 source, no forwarder is configured (the check is a NULL test, as on a device
+    without forwarding rules), and loopback sockets stand in for lwIP.
+
+    dns_replay_bench <corpus dir> [clients] [queries per client] [bursts]
+*/
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "host_engine.h"
+#include "host_udp_server.h"
+
+#define REPLY_TIMEOUT_NS (1000000000LL)
+#define MAX_CLIENTS (64)
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const int64_t *sorted, int count, double p)
+{
+    return count ? sorted[(int)(p * (count - 1))] / 1000.0 : 0;
+}
+
+// Reads every reply already queued on the client sockets
+static void collect(int *socks, int clients, int per_client, const int64_t *sent_ns, int64_t *latencies, int *answered, int wait_ms)
+{
+    struct pollfd fds[MAX_CLIENTS];
+    for (int c = 0; c < clients; c++) {
+        fds[c] = (struct pollfd) { .fd = socks[c], .events = POLLIN };
+    }
+    if (poll(fds, clients, wait_ms) <= 0) {
+        return;
+    }
+    for (int c = 0; c < clients; c++) {
+        char buf[DNS_EDNS_MAX_LEN];
+        int len;
+        while ((len = recv(socks[c], buf, sizeof(buf), MSG_DONTWAIT)) >= (int)sizeof(dns_header_t)) {
+            int64_t now = now_ns();
+            int q = ntohs(((dns_header_t *)buf)->id);
+            if (q / per_client == c && sent_ns[q] && latencies[q] == 0) {
+                latencies[q] = now - sent_ns[q];
+                (*answered)++;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <corpus dir> [clients] [queries per client] [bursts]\n", argv[0]);
+        return 2;
+    }
+    int clients = argc > 2 ? atoi(argv[2]) : 8;
+    int per_client = argc > 3 ? atoi(argv[3]) : 32;
+    int bursts = argc > 4 ? atoi(argv[4]) : 50;
+    if (clients < 1 || clients > MAX_CLIENTS || per_client < 1 || clients * per_client > 0xFFFF || bursts < 1) {
+        fprintf(stderr, "Between 1 and %d clients, at most %d queries in all\n", MAX_CLIENTS, 0xFFFF);
+        return 2;
+    }
+
+    host_query_t *corpus;
+    int corpus_count = host_corpus_load(argv[1], &corpus);
+    if (corpus_count <= 0) {
+        fprintf(stderr, "No corpus in %s\n", argv[1]);
+        return 1;
+    }
+    dns_engine_t engine;
+    host_engine_init(&engine);
+
+    // Only the queries that get an answer are probes, the malformed ones would just be lost
+    host_query_t **probes = malloc(corpus_count * sizeof(host_query_t *));
+    int num_probes = 0;
+    for (int i = 0; i < corpus_count; i++) {
+        char buf[DNS_EDNS_MAX_LEN];
+        memcpy(buf, corpus[i].data, corpus[i].len);
+        if (dns_engine_answer(&engine, buf, corpus[i].len, sizeof(buf), false) > 0) {
+            probes[num_probes++] = &corpus[i];
+        }
+    }
+    if (num_probes == 0) {
+        fprintf(stderr, "No answered query in %s\n", argv[1]);
+        return 1;
+    }
+
+    host_udp_server_t *server = host_udp_server_start(&engine);
+    if (server == NULL) {
+        perror("host_udp_server_start");
+        return 1;
+    }
+    struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(host_udp_server_port(server)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int socks[MAX_CLIENTS];
+    for (int c = 0; c < clients; c++) {
+        socks[c] = socket(AF_INET, SOCK_DGRAM, 0);
+        int rcvbuf = 1 << 20;
+        setsockopt(socks[c], SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        connect(socks[c], (struct sockaddr *)&server_addr, sizeof(server_addr));
+    }
+
+    int burst_len = clients * per_client;
+    int64_t *sent_ns = calloc(burst_len, sizeof(int64_t));
+    int64_t *burst_latencies = calloc(burst_len, sizeof(int64_t));
+    int64_t *latencies = malloc((size_t)bursts * burst_len * sizeof(int64_t));
+    int total_answered = 0;
+    int64_t busy_ns = 0;
+
+    for (int b = 0; b < bursts; b++) {
+        memset(sent_ns, 0, burst_len * sizeof(int64_t));
+        memset(burst_latencies, 0, burst_len * sizeof(int64_t));
+        int answered = 0;
+        int64_t start = now_ns();
+        // Round robin over the clients, each one sending its probes in order
+        for (int n = 0; n < burst_len; n++) {
+            int c = n % clients;
+            int q = c * per_client + n / clients;
+            const host_query_t *probe = probes[q % num_probes];
+            char buf[DNS_EDNS_MAX_LEN];
+            memcpy(buf, probe->data, probe->len);
+            ((dns_header_t *)buf)->id = htons(q);
+            sent_ns[q] = now_ns();
+            send(socks[c], buf, probe->len, 0);
+            collect(socks, clients, per_client, sent_ns, burst_latencies, &answered, 0);
+        }
+        while (answered < burst_len && now_ns() - start < REPLY_TIMEOUT_NS) {
+            collect(socks, clients, per_client, sent_ns, burst_latencies, &answered, 10);
+        }
+        busy_ns += now_ns() - start;
+        for (int q = 0; q < burst_len; q++) {
+            if (burst_latencies[q]) {
+                latencies[total_answered++] = burst_latencies[q];
+            }
+        }
+    }
+
+    host_udp_server_stats_t stats;
+    host_udp_server_stop(server, &stats);
+    for (int c = 0; c < clients; c++) {
+        close(socks[c]);
+    }
+
+    qsort(latencies, total_answered, sizeof(int64_t), cmp_int64);
+    int total = bursts * burst_len;
+    printf("%d bursts of %d clients x %d queries (%d probes): %d sent, %d answered, %d lost\n",
+           bursts, clients, per_client, num_probes, total, total_answered, total - total_answered);
+    printf("%.0f queries/s, %.1f queries per wakeup, %u rate limited\n",
+           total_answered / (busy_ns / 1e9), stats.wakeups ? (double)stats.queries / stats.wakeups : 0,
+           (unsigned)stats.rate_limited);
+    printf("latency p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           percentile_us(latencies, total_answered, 0.5), percentile_us(latencies, total_answered, 0.99),
+           percentile_us(latencies, total_answered, 0.999), percentile_us(latencies, total_answered, 1.0));
+
+    free(sent_ns);
+    free(burst_latencies);
+    free(latencies);
+    free(probes);
+    host_corpus_free(corpus, corpus_count);
+    return total_answered ? 0 : 1;
+}
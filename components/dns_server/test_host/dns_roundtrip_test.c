@@ -0,0 +1,211 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Resolver round trips against host_udp_server: a stub resolver with a timeout and retries sends
+    the probe sets iOS and Android fire on joining, over IPv4 and IPv6, and every question has to come
+    back on the first try with the right outcome, an address, NODATA or NXDOMAIN
+*/
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "host_engine.h"
+#include "host_udp_server.h"
+
+#define RESOLVER_TIMEOUT_MS (200)
+#define RESOLVER_TRIES (3)
+
+typedef struct {
+    const char *name;
+    uint16_t type;
+    uint16_t rcode;
+    uint16_t an_count;  // all answers of the expected type, with the fixture's address
+} probe_t;
+
+static const probe_t s_ios_probes[] = {
+    { "captive.apple.com", QD_TYPE_A, RCODE_NOERROR, 1 },
+    { "captive.apple.com", QD_TYPE_AAAA, RCODE_NOERROR, 0 },
+    { "captive.apple.com", QD_TYPE_HTTPS, RCODE_NOERROR, 0 },
+    { "www.apple.com", QD_TYPE_A, RCODE_NOERROR, 1 },
+    { "www.apple.com", QD_TYPE_AAAA, RCODE_NOERROR, 1 },
+};
+
+static const probe_t s_android_probes[] = {
+    { "connectivitycheck.gstatic.com", QD_TYPE_A, RCODE_NOERROR, 1 },
+    { "connectivitycheck.gstatic.com", QD_TYPE_AAAA, RCODE_NOERROR, 1 },
+    { "www.google.com", QD_TYPE_HTTPS, RCODE_NOERROR, 0 },
+    { "clients3.google.com", QD_TYPE_A, RCODE_NOERROR, 1 },
+};
+
+// Against an engine without the catch-all rule, where only captive.apple.com exists
+static const probe_t s_nxdomain_probes[] = {
+    { "captive.apple.com", QD_TYPE_A, RCODE_NOERROR, 1 },
+    { "captive.apple.com", QD_TYPE_HTTPS, RCODE_NOERROR, 0 },
+    { "connectivitycheck.gstatic.com", QD_TYPE_A, RCODE_NXDOMAIN, 0 },
+    { "connectivitycheck.gstatic.com", QD_TYPE_AAAA, RCODE_NXDOMAIN, 0 },
+};
+
+static int s_failures;
+static int s_timeouts;
+
+#define CHECK(cond, probe, ...) do { \
+        if (!(cond)) { \
+            printf("FAIL %s type %d: ", (probe)->name, (probe)->type); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            s_failures++; \
+            return; \
+        } \
+    } while (0)
+
+static int build_query(char *buf, uint16_t id, const char *name, uint16_t type)
+{
+    dns_header_t *header = (dns_header_t *)buf;
+    memset(header, 0, sizeof(*header));
+    header->id = htons(id);
+    header->flags = htons(RD_FLAG);
+    header->qd_count = htons(1);
+    char *ptr = buf + sizeof(dns_header_t);
+    while (*name) {
+        const char *dot = strchr(name, '.');
+        size_t len = dot ? (size_t)(dot - name) : strlen(name);
+        *ptr++ = len;
+        memcpy(ptr, name, len);
+        ptr += len;
+        name += dot ? len + 1 : len;
+    }
+    *ptr++ = 0;
+    uint16_t qtype = htons(type), qclass = htons(1);
+    memcpy(ptr, &qtype, 2);
+    memcpy(ptr + 2, &qclass, 2);
+    return ptr + 4 - buf;
+}
+
+// Sends the query like a stub resolver, again after every timeout; the reply's length or -1
+static int resolve(int sock, const char *query, int query_len, char *reply, size_t reply_size)
+{
+    for (int try = 0; try < RESOLVER_TRIES; try++) {
+        send(sock, query, query_len, 0);
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        while (poll(&pfd, 1, RESOLVER_TIMEOUT_MS) > 0) {
+            int len = recv(sock, reply, reply_size, 0);
+            if (len >= (int)sizeof(dns_header_t) && memcmp(reply, query, 2) == 0) {
+                return len;
+            }
+        }
+        s_timeouts++;
+    }
+    return -1;
+}
+
+static void check_probe(int sock, uint16_t id, const probe_t *probe)
+{
+    char query[DNS_MAX_LEN], reply[DNS_EDNS_MAX_LEN];
+    int query_len = build_query(query, id, probe->name, probe->type);
+    int len = resolve(sock, query, query_len, reply, sizeof(reply));
+    CHECK(len > 0, probe, "no reply after %d tries", RESOLVER_TRIES);
+
+    const dns_header_t *header = (const dns_header_t *)reply;
+    uint16_t flags = ntohs(header->flags);
+    CHECK((flags & QR_FLAG) && !(flags & TC_FLAG), probe, "flags 0x%04x", flags);
+    CHECK((flags & RCODE_MASK) == probe->rcode, probe, "rcode %d, expected %d", flags & RCODE_MASK, probe->rcode);
+    CHECK(ntohs(header->qd_count) == 1, probe, "%d questions", ntohs(header->qd_count));
+    CHECK(ntohs(header->an_count) == probe->an_count, probe, "%d answers, expected %d",
+          ntohs(header->an_count), probe->an_count);
+    CHECK(len >= query_len && memcmp(reply + sizeof(dns_header_t), query + sizeof(dns_header_t),
+                                        query_len - sizeof(dns_header_t)) == 0, probe, "question not echoed");
+
+    // Every record an_count announces has to be there, whole
+    const char *ptr = reply + query_len;
+    const char *end = reply + len;
+    for (int i = 0; i < probe->an_count; i++) {
+        ptr = dns_engine_skip_name(ptr, end);
+        CHECK(ptr && ptr + 10 <= end, probe, "answer %d cut short", i);
+        uint16_t type = (uint8_t)ptr[0] << 8 | (uint8_t)ptr[1];
+        uint16_t rdata_len = (uint8_t)ptr[8] << 8 | (uint8_t)ptr[9];
+        ptr += 10;
+        CHECK(type == probe->type && ptr + rdata_len <= end, probe, "answer %d of type %d, %d bytes", i, type, rdata_len);
+
+        char expected[16];
+        const char *addr = probe->type == QD_TYPE_A ? HOST_ENGINE_SOFTAP_IP4 : HOST_ENGINE_SOFTAP_IP6;
+        int family = probe->type == QD_TYPE_A ? AF_INET : AF_INET6;
+        CHECK(inet_pton(family, addr, expected) == 1 && rdata_len == (family == AF_INET ? 4 : 16) &&
+              memcmp(ptr, expected, rdata_len) == 0, probe, "answer %d has the wrong address", i);
+        ptr += rdata_len;
+    }
+}
+
+static void run_probes_over(host_udp_server_t *server, int family, const char *set, const probe_t *probes, int count)
+{
+    struct sockaddr_in addr4 = {
+        .sin_family = AF_INET,
+        .sin_port = htons(host_udp_server_port(server)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    struct sockaddr_in6 addr6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(host_udp_server_port(server)),
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+    int sock = socket(family, SOCK_DGRAM, 0);
+    if (family == AF_INET) {
+        connect(sock, (struct sockaddr *)&addr4, sizeof(addr4));
+    } else {
+        connect(sock, (struct sockaddr *)&addr6, sizeof(addr6));
+    }
+    int failures = s_failures, timeouts = s_timeouts;
+    for (int i = 0; i < count; i++) {
+        check_probe(sock, 0x4000 + i, &probes[i]);
+    }
+    close(sock);
+    printf("%-10s %-4s %d probes, %d failed, %d timeouts\n", set, family == AF_INET ? "ipv4" : "ipv6",
+           count, s_failures - failures, s_timeouts - timeouts);
+}
+
+static void run_probes(dns_engine_t *engine, const char *set, const probe_t *probes, int count)
+{
+    host_udp_server_t *server = host_udp_server_start(engine);
+    if (server == NULL) {
+        perror("host_udp_server_start");
+        s_failures++;
+        return;
+    }
+    run_probes_over(server, AF_INET, set, probes, count);
+    if (host_udp_server_has_ipv6(server)) {
+        run_probes_over(server, AF_INET6, set, probes, count);
+    } else {
+        printf("%-10s ipv6 skipped, no ::1 on this host\n", set);
+    }
+    host_udp_server_stop(server, NULL);
+}
+
+int main(void)
+{
+    dns_engine_t engine;
+    host_engine_init(&engine);
+    run_probes(&engine, "ios", s_ios_probes, sizeof(s_ios_probes) / sizeof(s_ios_probes[0]));
+    run_probes(&engine, "android", s_android_probes, sizeof(s_android_probes) / sizeof(s_android_probes[0]));
+
+    static dns_engine_rule_t rules[] = { { .name = "captive.apple.com" } };
+    static dns_rule_slot_t index[4];
+    inet_pton(AF_INET, HOST_ENGINE_SOFTAP_IP4, &rules[0].ip4);
+    dns_engine_t no_catch_all = { 0 };
+    if (dns_engine_index_slots(1) > sizeof(index) / sizeof(index[0])) {
+        printf("FAIL index of %zu slots\n", dns_engine_index_slots(1));
+        return 1;
+    }
+    dns_engine_init(&no_catch_all, rules, 1, index);
+    run_probes(&no_catch_all, "nxdomain", s_nxdomain_probes, sizeof(s_nxdomain_probes) / sizeof(s_nxdomain_probes[0]));
+
+    // A resolver waiting out a timeout is the delay this is about, none may happen
+    return s_failures || s_timeouts ? 1 : 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Runs the fuzz target over a corpus without libFuzzer, e.g. with gcc or as a regression test:
+    every query as it is, then every truncation and single-byte corruption of it
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include "host_engine.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <corpus dir>\n", argv[0]);
+        return 2;
+    }
+    host_query_t *queries;
+    int count = host_corpus_load(argv[1], &queries);
+    if (count <= 0) {
+        fprintf(stderr, "No corpus in %s\n", argv[1]);
+        return 1;
+    }
+
+    long runs = 0;
+    for (int i = 0; i < count; i++) {
+        uint8_t *data = (uint8_t *)queries[i].data;
+        size_t len = queries[i].len;
+        for (size_t cut = 0; cut <= len; cut++) {
+            LLVMFuzzerTestOneInput(data, cut);
+            runs++;
+        }
+        for (size_t pos = 0; pos < len; pos++) {
+            uint8_t saved = data[pos];
+            static const uint8_t values[] = { 0x00, 0x01, 0x3f, 0x40, 0x7f, 0xc0, 0xff };
+            for (size_t v = 0; v < sizeof(values); v++) {
+                data[pos] = values[v];
+                LLVMFuzzerTestOneInput(data, len);
+                runs++;
+            }
+            data[pos] = saved ^ 0x80;
+            LLVMFuzzerTestOneInput(data, len);
+            data[pos] = saved;
+            runs++;
+        }
+    }
+    printf("%d queries, %ld runs\n", count, runs);
+    host_corpus_free(queries, count);
+    return 0;
+}
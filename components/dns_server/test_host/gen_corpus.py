@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+# SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+# SPDX-License-Identifier: Unlicense OR CC0-1.0
+"""
+Writes the seed corpus of the fuzz target and the benchmark: the connectivity probes Android, iOS
+and Windows send when joining the portal's network, and malformed messages around the parser's limits.
+
+    python3 gen_corpus.py [corpus dir]
+"""
+import os
+import struct
+import sys
+
+TYPE_A = 1
+TYPE_AAAA = 28
+TYPE_HTTPS = 65
+TYPE_OPT = 41
+CLASS_IN = 1
+
+
+def name(qname):
+    out = b''
+    for label in qname.split('.'):
+        out += bytes([len(label)]) + label.encode()
+    return out + b'\0'
+
+
+def header(qid, qd_count=1, ar_count=0, flags=0x0100):
+    return struct.pack('!HHHHHH', qid, flags, qd_count, 0, 0, ar_count)
+
+
+def question(qname, qtype):
+    return name(qname) + struct.pack('!HH', qtype, CLASS_IN)
+
+
+def opt(udp_size=1232, version=0):
+    return b'\0' + struct.pack('!HHBBHH', TYPE_OPT, udp_size, 0, version, 0, 0)
+
+
+def query(qname, qtype, qid=0x1234, edns=False):
+    return header(qid, ar_count=1 if edns else 0) + question(qname, qtype) + (opt() if edns else b'')
+
+
+CORPUS = {
+    'android_a': query('connectivitycheck.gstatic.com', TYPE_A, 0x0a01),
+    'android_aaaa': query('connectivitycheck.gstatic.com', TYPE_AAAA, 0x0a02),
+    'android_https': query('www.google.com', TYPE_HTTPS, 0x0a03, edns=True),
+    'android_edns_a': query('clients3.google.com', TYPE_A, 0x0a04, edns=True),
+    'ios_a': query('captive.apple.com', TYPE_A, 0x1a01),
+    'ios_aaaa': query('captive.apple.com', TYPE_AAAA, 0x1a02),
+    'ios_https': query('captive.apple.com', TYPE_HTTPS, 0x1a03, edns=True),
+    'ios_mixed_case': query('CaPtIvE.aPpLe.CoM', TYPE_A, 0x1a04),
+    'windows_a': query('www.msftconnecttest.com', TYPE_A, 0x2a01),
+    'windows_ncsi': query('dns.msftncsi.com', TYPE_A, 0x2a02),
+    'wildcard_a': query('deep.sub.example.com', TYPE_A, 0x3a01),
+    'forward_a': query('upstream.test', TYPE_A, 0x3a02),
+    'multi_question': header(0x4a01, qd_count=2) + question('captive.apple.com', TYPE_A)
+    + b'\xc0\x0c' + struct.pack('!HH', TYPE_AAAA, CLASS_IN),
+    'edns_badvers': header(0x4a02, ar_count=1) + question('captive.apple.com', TYPE_A) + opt(version=1),
+    'pointer_loop': header(0x4a04) + b'\xc0\x0c' + struct.pack('!HH', TYPE_A, CLASS_IN),
+    'pointer_forward': header(0x4a05) + b'\xc0\x12' + struct.pack('!HH', TYPE_A, CLASS_IN) + name('x.y'),
+    'label_too_long': header(0x4a06) + bytes([64]) + b'a' * 64 + b'\0' + struct.pack('!HH', TYPE_A, CLASS_IN),
+    'truncated_question': query('captive.apple.com', TYPE_A, 0x4a07)[:20],
+    'response_bit': header(0x4a08, flags=0x8100) + question('captive.apple.com', TYPE_A),
+    'opcode_status': header(0x4a09, flags=0x1000) + question('captive.apple.com', TYPE_A),
+    'no_question': header(0x4a0a, qd_count=0),
+}
+# Four questions with a UDP limit too small for their answers, cut and flagged truncated
+CORPUS['edns_small_udp'] = header(0x4a03, qd_count=4, ar_count=1) + b''.join(
+    question('n%d.example.com' % i, TYPE_AAAA) for i in range(4)) + opt(udp_size=64)
+
+
+def main():
+    out_dir = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(os.path.abspath(__file__)), 'corpus')
+    os.makedirs(out_dir, exist_ok=True)
+    for key, data in sorted(CORPUS.items()):
+        with open(os.path.join(out_dir, key + '.bin'), 'wb') as f:
+            f.write(data)
+    print('%d queries written to %s' % (len(CORPUS), out_dir))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,87 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "host_engine.h"
+
+static dns_engine_rule_t s_rules[] = {
+    { .name = "captive.apple.com" },
+    { .name = "*.example.com" },
+    { .name = "upstream.test", .forward = true },
+    { .name = "*" },
+};
+
+#define RULES_COUNT ((int)(sizeof(s_rules) / sizeof(s_rules[0])))
+
+void host_engine_init(dns_engine_t *engine)
+{
+    static dns_rule_slot_t *index;
+    if (index == NULL) {
+        index = calloc(dns_engine_index_slots(RULES_COUNT), sizeof(dns_rule_slot_t));
+    } else {
+        memset(index, 0, dns_engine_index_slots(RULES_COUNT) * sizeof(dns_rule_slot_t));
+    }
+    for (int i = 0; i < RULES_COUNT; i++) {
+        inet_pton(AF_INET, HOST_ENGINE_SOFTAP_IP4, &s_rules[i].ip4);
+    }
+    inet_pton(AF_INET6, HOST_ENGINE_SOFTAP_IP6, s_rules[RULES_COUNT - 1].ip6);
+    memset(engine, 0, sizeof(*engine));
+    dns_engine_init(engine, s_rules, RULES_COUNT, index);
+}
+
+static int query_cmp(const void *a, const void *b)
+{
+    return strcmp(((const host_query_t *)a)->name, ((const host_query_t *)b)->name);
+}
+
+int host_corpus_load(const char *dir, host_query_t **queries)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        return -1;
+    }
+    int count = 0;
+    host_query_t *list = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        FILE *f = fopen(path, "rb");
+        if (f == NULL) {
+            continue;
+        }
+        char buf[DNS_EDNS_MAX_LEN];
+        size_t len = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+
+        list = realloc(list, (count + 1) * sizeof(host_query_t));
+        host_query_t *q = &list[count++];
+        snprintf(q->name, sizeof(q->name), "%.63s", entry->d_name);
+        q->data = malloc(len ? len : 1);
+        memcpy(q->data, buf, len);
+        q->len = len;
+    }
+    closedir(d);
+    qsort(list, count, sizeof(host_query_t), query_cmp);
+    *queries = list;
+    return count;
+}
+
+void host_corpus_free(host_query_t *queries, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(queries[i].data);
+    }
+    free(queries);
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    Shared by the host tools: an engine set up like the captive portal's and the probe query corpus
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include "dns_engine.h"
+
+// Addresses the fixture's rules answer with, network order
+#define HOST_ENGINE_SOFTAP_IP4 "192.168.4.1"
+#define HOST_ENGINE_SOFTAP_IP6 "fe80::1"
+
+typedef struct {
+    char name[64];
+    char *data;
+    size_t len;
+} host_query_t;
+
+/**
+ * Sets the engine up with the portal's catch-all "*" rule (IPv4 and IPv6), an exact IPv4-only
+ * rule for captive.apple.com, a "*.example.com" wildcard and a forwarded "upstream.test"
+ */
+void host_engine_init(dns_engine_t *engine);
+
+/**
+ * Loads every file of dir as one query, sorted by file name
+ * @return number of queries, -1 if dir cannot be read
+ */
+int host_corpus_load(const char *dir, host_query_t **queries);
+
+void host_corpus_free(host_query_t *queries, int count);
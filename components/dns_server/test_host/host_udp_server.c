@@ -0,0 +1,205 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include "dns_responder.h"
+#include "host_udp_server.h"
+
+#define DRAIN_BATCH (16)    // as DNS_DRAIN_BATCH of dns_server.c
+#define RCVBUF_SIZE (1 << 20)
+// Every benchmark client shares 127.0.0.1, the limiter is charged for each query but never has to drop one
+#define RATE_LIMIT_QPS (1000000)
+#define RATE_LIMIT_BURST (1000000)
+
+struct host_udp_server {
+    dns_rate_limit_t rate_limit;
+    dns_responder_t responder;
+    int sock4;
+    int sock6;              // -1 if ::1 is not available
+    int ctrl[2];            // written to by host_udp_server_stop() to wake the thread up
+    uint16_t port;
+    pthread_t thread;
+    host_udp_server_stats_t stats;
+    char rx_buffer[DNS_EDNS_MAX_LEN];
+};
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// As dns_server_drain(), on the same dns_responder_handle() path
+static void drain(host_udp_server_t *s, int sock)
+{
+    for (int i = 0; i < DRAIN_BATCH; i++) {
+        struct sockaddr_in6 source_addr; // Large enough for both IPv4 or IPv6
+        socklen_t socklen = sizeof(source_addr);
+        int len = recvfrom(sock, s->rx_buffer, sizeof(s->rx_buffer), MSG_DONTWAIT, (struct sockaddr *)&source_addr, &socklen);
+        if (len < 0) {
+            return;
+        }
+        s->stats.queries++;
+        int reply_len = 0;
+        switch (dns_responder_handle(&s->responder, s->rx_buffer, len, sizeof(s->rx_buffer),
+                                     (struct sockaddr *)&source_addr, socklen, now_us(), &reply_len)) {
+        case DNS_RESPONDER_REPLY:
+            break;
+        case DNS_RESPONDER_FORWARDED:
+            continue;
+        case DNS_RESPONDER_DROP:
+            s->stats.drops++;
+            continue;
+        case DNS_RESPONDER_RATE_LIMITED:
+        case DNS_RESPONDER_FLOOD_START:
+            s->stats.rate_limited++;
+            continue;
+        }
+        if (sendto(sock, s->rx_buffer, reply_len, 0, (struct sockaddr *)&source_addr, socklen) == reply_len) {
+            s->stats.answers++;
+        }
+    }
+}
+
+static void *server_thread(void *arg)
+{
+    host_udp_server_t *s = arg;
+    while (true) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(s->sock4, &read_fds);
+        FD_SET(s->ctrl[0], &read_fds);
+        int max_fd = s->sock4 > s->ctrl[0] ? s->sock4 : s->ctrl[0];
+        if (s->sock6 >= 0) {
+            FD_SET(s->sock6, &read_fds);
+            max_fd = s->sock6 > max_fd ? s->sock6 : max_fd;
+        }
+        if (select(max_fd + 1, &read_fds, NULL, NULL, NULL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (FD_ISSET(s->ctrl[0], &read_fds)) {
+            break;
+        }
+        s->stats.wakeups++;
+        if (FD_ISSET(s->sock4, &read_fds)) {
+            drain(s, s->sock4);
+        }
+        if (s->sock6 >= 0 && FD_ISSET(s->sock6, &read_fds)) {
+            drain(s, s->sock6);
+        }
+    }
+    return NULL;
+}
+
+static int open_udp_socket(int family, const struct sockaddr *addr, socklen_t addr_len)
+{
+    int sock = socket(family, SOCK_DGRAM, 0);
+    int rcvbuf = RCVBUF_SIZE;
+    int v6only = 1;
+    if (sock < 0 ||
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0 ||
+            (family == AF_INET6 && setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) ||
+            bind(sock, addr, addr_len) < 0) {
+        if (sock >= 0) {
+            close(sock);
+        }
+        return -1;
+    }
+    return sock;
+}
+
+host_udp_server_t *host_udp_server_start(dns_engine_t *engine)
+{
+    host_udp_server_t *s = calloc(1, sizeof(host_udp_server_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    dns_rate_limit_init(&s->rate_limit, RATE_LIMIT_QPS, RATE_LIMIT_BURST);
+    // No forwarder on the host, it needs the upstream socket and timers of dns_server.c
+    s->responder = (dns_responder_t) {
+        .engine = engine, .rate_limit = &s->rate_limit
+    };
+    s->sock6 = -1;
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    s->sock4 = open_udp_socket(AF_INET, (struct sockaddr *)&addr, sizeof(addr));
+    if (s->sock4 < 0 ||
+            getsockname(s->sock4, (struct sockaddr *)&addr, &addr_len) < 0 ||
+            pipe(s->ctrl) < 0) {
+        goto err;
+    }
+    s->port = ntohs(addr.sin_port);
+
+    // Same port on ::1, a host without IPv6 loopback only gets IPv4
+    struct sockaddr_in6 addr6 = {
+        .sin6_family = AF_INET6,
+        .sin6_port = addr.sin_port,
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+    s->sock6 = open_udp_socket(AF_INET6, (struct sockaddr *)&addr6, sizeof(addr6));
+
+    if (pthread_create(&s->thread, NULL, server_thread, s) != 0) {
+        close(s->ctrl[0]);
+        close(s->ctrl[1]);
+        goto err;
+    }
+    return s;
+
+err:
+    if (s->sock4 >= 0) {
+        close(s->sock4);
+    }
+    if (s->sock6 >= 0) {
+        close(s->sock6);
+    }
+    free(s);
+    return NULL;
+}
+
+uint16_t host_udp_server_port(const host_udp_server_t *server)
+{
+    return server->port;
+}
+
+bool host_udp_server_has_ipv6(const host_udp_server_t *server)
+{
+    return server->sock6 >= 0;
+}
+
+void host_udp_server_stop(host_udp_server_t *server, host_udp_server_stats_t *stats)
+{
+    char dummy = 0;
+    if (write(server->ctrl[1], &dummy, 1) == 1) {
+        pthread_join(server->thread, NULL);
+    }
+    if (stats) {
+        *stats = server->stats;
+    }
+    close(server->sock4);
+    if (server->sock6 >= 0) {
+        close(server->sock6);
+    }
+    close(server->ctrl[0]);
+    close(server->ctrl[1]);
+    free(server);
+}
@@ -0,0 +1,45 @@
+/*
+ * SPDX-FileCopyrightText: 2021-2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Unlicense OR CC0-1.0
+ */
+
+/*
+    The UDP side of dns_server_task() on a host thread: select() on 127.0.0.1 and ::1, then run every
+    queued datagram through dns_responder_handle(), rate limiter included, before waiting again.
+    Unlike on the device there is no forwarder, so names of forwarding rules are answered locally
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "dns_engine.h"
+
+typedef struct host_udp_server host_udp_server_t;
+
+typedef struct {
+    uint32_t queries;
+    uint32_t answers;
+    uint32_t drops;
+    uint32_t rate_limited;
+    uint32_t wakeups;       // select() returns, queries / wakeups is the mean batch size
+} host_udp_server_stats_t;
+
+/**
+ * Starts answering with the engine on an ephemeral port of 127.0.0.1, and the same port of ::1 if available
+ * @return the server, NULL on failure
+ */
+host_udp_server_t *host_udp_server_start(dns_engine_t *engine);
+
+// Port the server listens on, host order
+uint16_t host_udp_server_port(const host_udp_server_t *server);
+
+// Whether the server also listens on ::1
+bool host_udp_server_has_ipv6(const host_udp_server_t *server);
+
+/**
+ * Stops the thread and frees the server
+ * @param stats filled in with the counters if not NULL
+ */
+void host_udp_server_stop(host_udp_server_t *server, host_udp_server_stats_t *stats);
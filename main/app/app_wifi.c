@@ -5,6 +5,7 @@
  */
 
 #include <string.h>
+#include <sys/param.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
@@ -20,6 +21,8 @@
 #include <lwip/inet.h>
 #include <esp_task_wdt.h>
 #include <esp_check.h>
+#include <esp_timer.h>
+#include <freertos/semphr.h>
 
 #include "app_wifi.h"
 #include "app_sntp.h"
@@ -31,9 +34,12 @@
 #include "ui_main.h"
 
 static bool s_connected = false;
+// Set by app_wifi_connect() until the attempt succeeds or fails, only its outcome is news for the portal page
+static volatile bool s_connect_attempt = false;
 static char s_payload[150] = "";
 static const char *TAG = "APP_WIFI";
 static const int WIFI_CONNECTED_EVENT = BIT0;
+static const int WIFI_SCAN_DONE_EVENT = BIT1;
 static EventGroupHandle_t wifi_event_group;
 
 esp_netif_t* netif;
@@ -53,6 +59,92 @@ static bool provisioned = false;
 
 static dns_server_handle_t dns_server;
 
+#define WIFI_SCAN_INTERVAL_US (30 * 1000 * 1000)
+#define WIFI_SCAN_MAX_APS 64
+
+/*
+ * Background scan service: scans run asynchronously and periodically, their results are published as
+ * ref-counted snapshots, so readers never wait for the radio and never see a snapshot freed under them
+ */
+static SemaphoreHandle_t s_scan_lock;
+static esp_timer_handle_t s_scan_timer;
+static wifi_scan_snapshot_t *s_scan_snapshot;
+static bool s_scanning;
+static bool s_scan_running;     // between wifi_scan_service_start() and _stop(), guarded by s_scan_lock
+
+static void wifi_scan_service_stop(void);
+static void wifi_scan_handle_done(void);
+
+// Time the portal page gets to learn about the new IP before the softAP goes away
+#define PORTAL_TEARDOWN_DELAY_US (5 * 1000 * 1000)
+#define PORTAL_TEARDOWN_STACK_SIZE 4096
+#define PORTAL_TEARDOWN_PRIORITY (tskIDLE_PRIORITY + 5)
+static esp_timer_handle_t s_teardown_timer;
+
+// Releases the portal's and DNS server's sockets once the board got online
+static void captive_portal_teardown(void)
+{
+    // The portal reads the DNS server's statistics, it goes first
+    stop_captive_portal();
+    if (dns_server) {
+        stop_dns_server(dns_server);
+        dns_server = NULL;
+    }
+    wifi_scan_service_stop();
+}
+
+// The softAP was only kept for the portal page to follow the connection attempt
+static void portal_teardown_task(void *arg)
+{
+    captive_portal_teardown();
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_ps(WIFI_PS_NONE));
+    vTaskDelete(NULL);
+}
+
+// Stopping the servers blocks for a while, not in the esp_timer task every other timer callback shares
+static void portal_teardown_timer_cb(void *arg)
+{
+    if (xTaskCreate(portal_teardown_task, "portal_teardown", PORTAL_TEARDOWN_STACK_SIZE, NULL,
+                    PORTAL_TEARDOWN_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start the portal teardown");
+    }
+}
+
+static void captive_portal_schedule_teardown(void)
+{
+    if (dns_server == NULL) {
+        // Started as a station, there is no portal
+        return;
+    }
+    if (s_teardown_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+                .callback = portal_teardown_timer_cb,
+                .name = "portal_teardown",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&timer_args, &s_teardown_timer));
+    }
+    esp_timer_stop(s_teardown_timer);
+    ESP_ERROR_CHECK(esp_timer_start_once(s_teardown_timer, PORTAL_TEARDOWN_DELAY_US));
+}
+
+static captive_portal_wifi_state_t wifi_disconnect_state(uint8_t reason)
+{
+    switch (reason) {
+        case WIFI_REASON_AUTH_FAIL:
+        case WIFI_REASON_AUTH_EXPIRE:
+        case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_HANDSHAKE_TIMEOUT:
+        case WIFI_REASON_MIC_FAILURE:
+        case WIFI_REASON_CONNECTION_FAIL:
+            return CAPTIVE_PORTAL_WIFI_AUTH_FAIL;
+        case WIFI_REASON_NO_AP_FOUND:
+            return CAPTIVE_PORTAL_WIFI_NOT_FOUND;
+        default:
+            return CAPTIVE_PORTAL_WIFI_DISCONNECTED;
+    }
+}
+
 static void app_wifi_print_qr(const char *name)
 {
     if (!name) {
@@ -86,6 +178,8 @@ static void event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGI(TAG, "station "MACSTR" leave, AID=%d", MAC2STR(event->mac), event->aid);
         } else if (event_id == WIFI_EVENT_AP_START) {
             ESP_LOGI(TAG, "WIFI_EVENT_AP_START");
+        } else if (event_id == WIFI_EVENT_SCAN_DONE) {
+            wifi_scan_handle_done();
         } else if (event_id == WIFI_EVENT_STA_START) {
             ESP_LOGD(TAG, "Event --- WIFI_EVENT_STA_START");
 
@@ -101,7 +195,14 @@ static void event_handler(void *arg, esp_event_base_t event_base,
             ESP_LOGD(TAG, "Event --- WIFI_EVENT_WIFI_READY");
             ESP_ERROR_CHECK(esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_11B | WIFI_PROTOCOL_11G));
         } else if (event_id == WIFI_EVENT_STA_DISCONNECTED) {
-            ESP_LOGI(TAG, "Disconnected. Connecting to the AP again...");
+            wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+            ESP_LOGI(TAG, "Disconnected, reason %d. Connecting to the AP again...", event->reason);
+            // Leaving on purpose is part of app_wifi_connect(), and the reconnect loop running before
+            // any credentials were submitted is not news for the portal page
+            if (s_connect_attempt && event->reason != WIFI_REASON_ASSOC_LEAVE) {
+                s_connect_attempt = false;
+                captive_portal_push_wifi_state(wifi_disconnect_state(event->reason), NULL);
+            }
 
             ESP_ERROR_CHECK(wifi_prov_mgr_is_provisioned(&provisioned));
 
@@ -127,9 +228,8 @@ static void event_handler(void *arg, esp_event_base_t event_base,
         case WIFI_PROV_CRED_RECV: {
             wifi_sta_config_t *wifi_sta_cfg = (wifi_sta_config_t *)event_data;
             ESP_LOGI(TAG, "Received Wi-Fi credentials"
-                     "\n\tSSID     : %s\n\tPassword : %s",
-                     (const char *) wifi_sta_cfg->ssid,
-                     (const char *) wifi_sta_cfg->password);
+                     "\n\tSSID     : %.*s",
+                     (int) sizeof(wifi_sta_cfg->ssid), (const char *) wifi_sta_cfg->ssid);
             break;
         }
         case WIFI_PROV_CRED_FAIL: {
@@ -161,6 +261,11 @@ static void event_handler(void *arg, esp_event_base_t event_base,
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
         ESP_LOGI(TAG, "Connected with IP Address:" IPSTR, IP2STR(&event->ip_info.ip));
+        char ip[16];
+        snprintf(ip, sizeof(ip), IPSTR, IP2STR(&event->ip_info.ip));
+        s_connect_attempt = false;
+        captive_portal_push_wifi_state(CAPTIVE_PORTAL_WIFI_GOT_IP, ip);
+        captive_portal_schedule_teardown();
         s_connected = 1;
         ui_acquire();
         ui_main_status_bar_set_wifi(s_connected);
@@ -208,17 +313,19 @@ esp_err_t app_wifi_start(void)
     if (!provisioned) {
         wifi_start_softap();
 
+        wifi_scan_service_start();
         start_captive_portal();
 
         // Start the DNS server that will redirect all queries to the softAP IP
         dns_server_config_t config = DNS_SERVER_CONFIG_SINGLE("*" /* all A queries */, "WIFI_AP_DEF" /* softAP netif ID */);
         dns_server = start_dns_server(&config);
+        captive_portal_set_dns_server(dns_server);
 
     } else {
         wifi_config_t config;
         esp_wifi_get_config(WIFI_IF_STA, &config);
 
-        ESP_LOGD(TAG, "WIFI_IF_STA SSID %s / Password: %s", config.sta.ssid, config.sta.password);
+        ESP_LOGD(TAG, "WIFI_IF_STA SSID %.*s", (int) sizeof(config.sta.ssid), config.sta.ssid);
 
         wifi_start_sta();
     };
@@ -234,6 +341,19 @@ esp_err_t app_wifi_start(void)
     return ESP_OK;
 }
 
+esp_err_t app_wifi_connect(void)
+{
+    // The softAP stays up meanwhile, so the portal page can follow the attempt over /ws
+    s_connect_attempt = true;
+    captive_portal_push_wifi_state(CAPTIVE_PORTAL_WIFI_CONNECTING, NULL);
+    esp_wifi_disconnect();
+    esp_err_t ret = esp_wifi_connect();
+    if (ret != ESP_OK) {
+        s_connect_attempt = false;
+    }
+    return ret;
+}
+
 bool app_wifi_is_connected(void)
 {
     return s_connected;
@@ -257,6 +377,25 @@ static void wifi_init_sta(void)
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 }
 
+#if CONFIG_PORTAL_DHCP_CAPTIVE_URI
+/*
+ * Advertise the captive portal API in DHCP option 114 (RFC 8910), so clients can ask for
+ * the portal right away instead of finding it by probing. The DHCP server keeps a pointer to the URI.
+ * Plain HTTP on the softAP address: RFC 8908 clients such as iOS and Android ignore it, see the Kconfig help
+ */
+static void dhcps_set_captive_portal_uri(const char *ip_addr)
+{
+    static char uri[sizeof("http://255.255.255.255" CAPTIVE_PORTAL_API_URI)];
+    snprintf(uri, sizeof(uri), "http://%s" CAPTIVE_PORTAL_API_URI, ip_addr);
+
+    esp_netif_t *ap_netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcps_stop(ap_netif));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcps_option(ap_netif, ESP_NETIF_OP_SET, ESP_NETIF_CAPTIVEPORTAL_URI, uri, strlen(uri)));
+    ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcps_start(ap_netif));
+    ESP_LOGI(TAG, "Captive portal API: %s", uri);
+}
+#endif
+
 static void wifi_start_softap(void)
 {
     ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
@@ -267,12 +406,6 @@ static void wifi_start_softap(void)
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&cfg));
 
-    ESP_ERROR_CHECK(esp_event_handler_instance_register(WIFI_EVENT,
-                                                        ESP_EVENT_ANY_ID,
-                                                        &event_handler,
-                                                        NULL,
-                                                        NULL));
-
     wifi_config_t wifi_config = {
             .ap = {
                     .ssid = FOLLOME2_ESP_WIFI_SSID,
@@ -306,8 +439,11 @@ static void wifi_start_softap(void)
     inet_ntoa_r(ip_info.ip.addr, ip_addr, 16);
     ESP_LOGI(TAG, "Set up softAP with IP: %s", ip_addr);
 
-    ESP_LOGI(TAG, "wifi_init_softap finished. SSID:'%s' password:'%s'",
-             FOLLOME2_ESP_WIFI_SSID, FOLLOME2_ESP_WIFI_PASS);
+#if CONFIG_PORTAL_DHCP_CAPTIVE_URI
+    dhcps_set_captive_portal_uri(ip_addr);
+#endif
+
+    ESP_LOGI(TAG, "wifi_init_softap finished. SSID:'%s'", FOLLOME2_ESP_WIFI_SSID);
 }
 
 //// WiFi scan
@@ -420,23 +556,208 @@ static void print_cipher_type(int pairwise_cipher, int group_cipher)
     }
 }
 
-/* Initialize Wi-Fi as sta and set scan method */
-esp_err_t wifi_scan(uint16_t number, wifi_ap_record_t *ap_info, uint16_t *ap_count)
+static void wifi_scan_log_records(const wifi_scan_snapshot_t *snapshot)
 {
-    ESP_RETURN_ON_ERROR(esp_wifi_scan_start(NULL, true), TAG, "");
-    ESP_RETURN_ON_ERROR(esp_wifi_scan_get_ap_records(&number, ap_info), TAG, "");
-    ESP_RETURN_ON_ERROR(esp_wifi_scan_get_ap_num(ap_count), TAG, "");
-    ESP_LOGI(TAG, "Total APs scanned = %u", *ap_count);
-
-    for (int i = 0; (i < number) && (i < *ap_count); i++) {
-        ESP_LOGI(TAG, "SSID \t\t%s", ap_info[i].ssid);
-        ESP_LOGI(TAG, "RSSI \t\t%d", ap_info[i].rssi);
-        print_auth_mode(ap_info[i].authmode);
-        if (ap_info[i].authmode != WIFI_AUTH_WEP) {
-            print_cipher_type(ap_info[i].pairwise_cipher, ap_info[i].group_cipher);
+    ESP_LOGI(TAG, "Total APs scanned = %u", snapshot->ap_count);
+    if (esp_log_level_get(TAG) < ESP_LOG_DEBUG) {
+        return;
+    }
+    for (int i = 0; i < snapshot->ap_count; i++) {
+        const wifi_ap_record_t *ap = &snapshot->ap[i];
+        ESP_LOGI(TAG, "SSID \t\t%s", ap->ssid);
+        ESP_LOGI(TAG, "RSSI \t\t%d", ap->rssi);
+        print_auth_mode(ap->authmode);
+        if (ap->authmode != WIFI_AUTH_WEP) {
+            print_cipher_type(ap->pairwise_cipher, ap->group_cipher);
         }
-        ESP_LOGI(TAG, "Channel \t\t%d", ap_info[i].primary);
+        ESP_LOGI(TAG, "Channel \t\t%d", ap->primary);
     }
+}
+
+// Drops a reference, the caller must hold s_scan_lock
+static void wifi_scan_snapshot_unref(wifi_scan_snapshot_t *snapshot)
+{
+    if (snapshot && --snapshot->refs == 0) {
+        free(snapshot);
+    }
+}
 
+// Starts a scan unless one is running already, concurrent requests share its result
+static esp_err_t wifi_scan_request(void)
+{
+    esp_err_t ret = ESP_OK;
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    if (!s_scan_running) {
+        ret = ESP_ERR_INVALID_STATE;
+    } else if (!s_scanning) {
+        xEventGroupClearBits(wifi_event_group, WIFI_SCAN_DONE_EVENT);
+        ret = esp_wifi_scan_start(NULL, false);
+        s_scanning = ret == ESP_OK;
+    }
+    xSemaphoreGive(s_scan_lock);
+    if (ret != ESP_OK) {
+        // e.g. while the station is connecting, the next period retries
+        ESP_LOGD(TAG, "Scan not started: %s", esp_err_to_name(ret));
+    }
+    return ret;
+}
+
+static void wifi_scan_timer_cb(void *arg)
+{
+    wifi_scan_request();
+}
+
+static int wifi_ap_cmp_ssid(const void *a, const void *b)
+{
+    const wifi_ap_record_t *ap_a = a, *ap_b = b;
+    int cmp = strncmp((const char *)ap_a->ssid, (const char *)ap_b->ssid, sizeof(ap_a->ssid));
+    return cmp ? cmp : ap_b->rssi - ap_a->rssi;
+}
+
+static int wifi_ap_cmp_rssi(const void *a, const void *b)
+{
+    const wifi_ap_record_t *ap_a = a, *ap_b = b;
+    return ap_b->rssi - ap_a->rssi;
+}
+
+// Keeps the strongest AP of every SSID, strongest first; hidden networks cannot be picked by name and are dropped
+static uint16_t wifi_scan_dedupe(wifi_ap_record_t *ap, uint16_t ap_count)
+{
+    qsort(ap, ap_count, sizeof(*ap), wifi_ap_cmp_ssid);
+    uint16_t n = 0;
+    for (int i = 0; i < ap_count; i++) {
+        if (ap[i].ssid[0] == '\0' ||
+            (n > 0 && strncmp((const char *)ap[n - 1].ssid, (const char *)ap[i].ssid, sizeof(ap->ssid)) == 0)) {
+            continue;
+        }
+        if (n != i) {
+            ap[n] = ap[i];
+        }
+        n++;
+    }
+    qsort(ap, n, sizeof(*ap), wifi_ap_cmp_rssi);
+    return n;
+}
+
+// WIFI_EVENT_SCAN_DONE: takes the records out of the driver and publishes them as the new snapshot
+static void wifi_scan_handle_done(void)
+{
+    if (s_scan_lock == NULL) {
+        return;
+    }
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    bool running = s_scan_running;
+    if (!running) {
+        s_scanning = false;
+    }
+    xSemaphoreGive(s_scan_lock);
+    if (!running) {
+        // Finished or aborted after the service stopped, nobody would release the results
+        esp_wifi_clear_ap_list();
+        xEventGroupSetBits(wifi_event_group, WIFI_SCAN_DONE_EVENT);
+        return;
+    }
+
+    uint16_t ap_count = 0;
+    esp_wifi_scan_get_ap_num(&ap_count);
+    ap_count = MIN(ap_count, WIFI_SCAN_MAX_APS);
+
+    wifi_scan_snapshot_t *snapshot = malloc(sizeof(wifi_scan_snapshot_t) + ap_count * sizeof(wifi_ap_record_t));
+    if (snapshot == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate the scan snapshot");
+        esp_wifi_clear_ap_list();
+    } else {
+        // Also frees the driver's copy of the records, including the ones beyond ap_count
+        if (esp_wifi_scan_get_ap_records(&ap_count, snapshot->ap) != ESP_OK) {
+            ap_count = 0;
+        }
+        snapshot->ap_count = wifi_scan_dedupe(snapshot->ap, ap_count);
+        snapshot->timestamp_us = esp_timer_get_time();
+        snapshot->refs = 1;
+        wifi_scan_log_records(snapshot);
+    }
+
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    if (snapshot) {
+        wifi_scan_snapshot_unref(s_scan_snapshot);
+        s_scan_snapshot = snapshot;
+    }
+    s_scanning = false;
+    xSemaphoreGive(s_scan_lock);
+    xEventGroupSetBits(wifi_event_group, WIFI_SCAN_DONE_EVENT);
+}
+
+esp_err_t wifi_scan_service_start(void)
+{
+    if (s_scan_lock == NULL) {
+        s_scan_lock = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(s_scan_lock, ESP_ERR_NO_MEM, TAG, "Failed to create the scan lock");
+    }
+    if (s_scan_timer == NULL) {
+        const esp_timer_create_args_t timer_args = {
+                .callback = wifi_scan_timer_cb,
+                .name = "wifi_scan",
+        };
+        ESP_RETURN_ON_ERROR(esp_timer_create(&timer_args, &s_scan_timer), TAG, "Failed to create the scan timer");
+        ESP_RETURN_ON_ERROR(esp_timer_start_periodic(s_scan_timer, WIFI_SCAN_INTERVAL_US), TAG, "Failed to start the scan timer");
+    }
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    s_scan_running = true;
+    xSemaphoreGive(s_scan_lock);
+    // The first result is wanted as soon as possible, the portal page asks for it right away
+    wifi_scan_request();
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+static void wifi_scan_service_stop(void)
+{
+    if (s_scan_timer) {
+        esp_timer_stop(s_scan_timer);
+        esp_timer_delete(s_scan_timer);
+        s_scan_timer = NULL;
+    }
+    if (s_scan_lock) {
+        xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+        s_scan_running = false;
+        if (s_scanning) {
+            // Its SCAN_DONE finds the service stopped and drops the results
+            esp_wifi_scan_stop();
+            s_scanning = false;
+        }
+        wifi_scan_snapshot_unref(s_scan_snapshot);
+        s_scan_snapshot = NULL;
+        xSemaphoreGive(s_scan_lock);
+        // Nothing is coming for fresh-scan waiters any more
+        xEventGroupSetBits(wifi_event_group, WIFI_SCAN_DONE_EVENT);
+    }
+}
+
+wifi_scan_snapshot_t *wifi_scan_get(bool fresh, TickType_t timeout)
+{
+    ESP_RETURN_ON_FALSE(s_scan_lock, NULL, TAG, "Scan service not started");
+
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    bool wait = fresh || s_scan_snapshot == NULL;
+    xSemaphoreGive(s_scan_lock);
+
+    if (wait && wifi_scan_request() == ESP_OK) {
+        xEventGroupWaitBits(wifi_event_group, WIFI_SCAN_DONE_EVENT, false, true, timeout);
+    }
+
+    xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+    wifi_scan_snapshot_t *snapshot = s_scan_snapshot;
+    if (snapshot) {
+        snapshot->refs++;
+    }
+    xSemaphoreGive(s_scan_lock);
+    return snapshot;
+}
+
+void wifi_scan_release(wifi_scan_snapshot_t *snapshot)
+{
+    if (snapshot) {
+        xSemaphoreTake(s_scan_lock, portMAX_DELAY);
+        wifi_scan_snapshot_unref(snapshot);
+        xSemaphoreGive(s_scan_lock);
+    }
+}
@@ -7,6 +7,7 @@
 #pragma once
 #include <esp_err.h>
 #include <esp_wifi_types.h>
+#include <freertos/FreeRTOS.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,16 +20,38 @@ typedef struct {
 void app_wifi_init();
 esp_err_t app_wifi_start(void);
 char *app_wifi_get_prov_payload(void);
+// Connects the station with the stored config, the softAP stays up while it tries
+esp_err_t app_wifi_connect(void);
 bool app_wifi_is_connected(void);
 esp_err_t app_wifi_get_wifi_ssid(char *ssid, size_t len);
 
 /**
- * 扫描wifi ssid
- * @param number 最大扫描数量
- * @param ap_info 扫描结果
- * @param ap_count 扫描到的数量
+ * Result of one Wi-Fi scan, shared by reference: release every snapshot taken with wifi_scan_get()
  */
-esp_err_t wifi_scan(uint16_t number, wifi_ap_record_t *ap_info, uint16_t *ap_count);
+typedef struct {
+    int64_t timestamp_us;       // esp_timer_get_time() when the scan finished
+    uint32_t refs;
+    uint16_t ap_count;
+    wifi_ap_record_t ap[];      // strongest AP of every SSID, strongest first
+} wifi_scan_snapshot_t;
+
+/**
+ * 启动后台wifi扫描：立即扫描一次，之后定期刷新
+ */
+esp_err_t wifi_scan_service_start(void);
+
+/**
+ * 获取最近一次的扫描结果
+ * @param fresh 为true时等待下一次扫描完成（正在进行的扫描会被共享）
+ * @param timeout 等待扫描的最长时间，没有任何结果时也会等待
+ * @return 扫描结果，需用wifi_scan_release()释放；尚无结果时为NULL
+ */
+wifi_scan_snapshot_t *wifi_scan_get(bool fresh, TickType_t timeout);
+
+/**
+ * 释放wifi_scan_get()返回的扫描结果
+ */
+void wifi_scan_release(wifi_scan_snapshot_t *snapshot);
 
 #ifdef __cplusplus
 }
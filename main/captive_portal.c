@@ -2,20 +2,39 @@
 // Created by Hessian on 2023/9/6.
 //
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <esp_log.h>
 #include <esp_wifi_types.h>
 #include <esp_wifi.h>
-#include <ctype.h>
+#include <esp_netif.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <esp_check.h>
+#include <esp_timer.h>
+#include <esp_rom_crc.h>
+#include <json_generator.h>
 #include "captive_portal.h"
 #include "app_wifi.h"
+#include "dns_server.h"
+#include "portal_assets_manifest.h"
+#include "portal_assets.h"
+#include "portal_form.h"
+#include "portal_async.h"
+#include "portal_metrics.h"
+#include "portal_cache.h"
 
 static const char *TAG = "CAPTIVE_PORTAL";
 
 #define HTML_BUF_SIZE 2048
 
 static httpd_handle_t server = NULL;
+// Guards server against tasks outside the server, e.g. the Wi-Fi events pushing to /ws while the portal stops
+static SemaphoreHandle_t s_server_lock;
+// Set while the DNS server runs next to the portal, stopped only after the portal
+static dns_server_handle_t s_dns_server;
 
 bool file_ext_cmp(const char *filename, const char *extension) {
     // 获取文件名中最后一个点的位置
@@ -28,24 +47,99 @@ bool file_ext_cmp(const char *filename, const char *extension) {
     return false; // 没有扩展名或者不匹配
 }
 
-static esp_err_t send_file_response(httpd_req_t *req, char* filename)
+// Whether the client takes gzip encoded responses, "gzip;q=0" is a refusal
+static bool client_accepts_gzip(httpd_req_t *req)
 {
-    esp_err_t ret = ESP_OK;
-    FILE *fp = NULL;
-    char *buf = NULL;
-    size_t read_len = 0;
+    char accept[64];
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept, sizeof(accept));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return false;
+    }
+
+    const char *gzip = strstr(accept, "gzip");
+    if (gzip == NULL) {
+        return false;
+    }
+    const char *q = strstr(gzip, "q=");
+    const char *next = strchr(gzip, ',');
+    return q == NULL || (next != NULL && q > next) || strtof(q + 2, NULL) > 0;
+}
 
-    fp = fopen(filename, "rb");
+static int portal_asset_cmp(const void *path, const void *asset)
+{
+    return strcmp(path, ((const portal_asset_t *)asset)->path);
+}
+
+/*
+ * Finds the asset a request URI refers to in the index generated with the image, the query does not matter.
+ * The path is normalised on the way: repeated slashes and "." segments go, ".." is refused rather than resolved.
+ * Nothing longer than the longest asset path is looked at any further
+ */
+static const portal_asset_t *portal_asset_find(const char *uri)
+{
+    char path[PORTAL_ASSET_PATH_MAX_LEN + 1];
+    size_t len = 0;
+    const char *end = uri + strcspn(uri, "?#");
 
-    ESP_GOTO_ON_FALSE(fp != NULL, ESP_ERR_NOT_FOUND, err, TAG, "Failed to open file %s", filename);
+    // Assets are files, "/index.html/" is not one
+    if (*uri != '/' || end[-1] == '/') {
+        return NULL;
+    }
+    while (uri < end) {
+        // uri is at a '/', look at the segment behind it
+        while (uri < end && *uri == '/') {
+            uri++;
+        }
+        const char *segment = uri;
+        while (uri < end && *uri != '/') {
+            uri++;
+        }
+        size_t segment_len = uri - segment;
+        if (segment_len == 0 || (segment_len == 1 && segment[0] == '.')) {
+            continue;
+        }
+        if ((segment_len == 2 && segment[0] == '.' && segment[1] == '.') ||
+            memchr(segment, '\\', segment_len) || memchr(segment, '%', segment_len)) {
+            return NULL;
+        }
+        if (len + 1 + segment_len > PORTAL_ASSET_PATH_MAX_LEN) {
+            return NULL;
+        }
+        path[len++] = '/';
+        memcpy(path + len, segment, segment_len);
+        len += segment_len;
+    }
+    if (len < PORTAL_ASSET_PATH_MIN_LEN) {
+        return NULL;
+    }
+    path[len] = '\0';
+    return bsearch(path, portal_assets, PORTAL_ASSETS_COUNT, sizeof(portal_asset_t), portal_asset_cmp);
+}
 
-    buf = calloc(HTML_BUF_SIZE, sizeof(char));
+// Whether the request asks for exactly this version of the asset, like the pages refer to it
+static bool request_is_versioned(httpd_req_t *req, const portal_asset_t *asset)
+{
+    char query[48];
+    char version[24];
+    return asset->versioned &&
+           httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+           httpd_query_key_value(query, "v", version, sizeof(version)) == ESP_OK &&
+           strcmp(version, asset->version) == 0;
+}
 
-    if (NULL == buf) {
-        ESP_LOGE(TAG, "Failed to allocate memory for buf");
-        return ESP_ERR_NO_MEM;
+// Whether If-None-Match of the request lists the given ETag
+static bool etag_matches(httpd_req_t *req, const char *etag)
+{
+    char if_none_match[128];
+    esp_err_t err = httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match));
+    if (err != ESP_OK && err != ESP_ERR_HTTPD_RESULT_TRUNC) {
+        return false;
     }
+    return strcmp(if_none_match, "*") == 0 || strstr(if_none_match, etag) != NULL;
+}
 
+static void set_content_type(httpd_req_t *req, const char *filename)
+{
     if (file_ext_cmp(filename, "js")) {
         httpd_resp_set_type(req, "text/javascript");
     } else if (file_ext_cmp(filename, "css")) {
@@ -53,78 +147,250 @@ static esp_err_t send_file_response(httpd_req_t *req, char* filename)
     } else {
         httpd_resp_set_type(req, "text/html");
     }
+}
 
-    while ((read_len = fread(buf, sizeof(char), HTML_BUF_SIZE, fp)) > 0) {
-        httpd_resp_send_chunk(req, buf, read_len);
+// Body of an asset response, picked before any header is set: mapped flash, the RAM cache or an open SPIFFS file
+typedef struct {
+    bool gzipped;
+    const char *data;       // the whole body, NULL if it is read from fp
+    size_t len;
+    const portal_cache_entry_t *cached;
+    FILE *fp;
+} asset_body_t;
+
+/*
+ * Finds the body of the asset's gzipped or plain variant. With fallback, a gzipped variant that cannot be had
+ * falls back to the plain one, body->gzipped tells which one it is. Close the body with asset_body_close()
+ */
+static esp_err_t asset_body_open(const portal_asset_t *asset, bool gz, bool fallback, asset_body_t *body)
+{
+    char filename[sizeof(CONFIG_BSP_SPIFFS_MOUNT_POINT) + PORTAL_ASSET_PATH_MAX_LEN + sizeof(".gz")];
+    memset(body, 0, sizeof(*body));
+
+#if CONFIG_PORTAL_ASSETS_BUNDLE
+    // Sent straight from mapped flash: no file, no buffer, one send
+    portal_asset_blob_t blob;
+    if (portal_assets_get(asset->path, gz, &blob) == ESP_OK && (fallback || blob.gzipped == gz)) {
+        body->gzipped = blob.gzipped;
+        body->data = blob.data;
+        body->len = blob.len;
+        return ESP_OK;
     }
+#endif
+
+    for (int variant = gz; variant >= (fallback ? 0 : gz); variant--) {
+        snprintf(filename, sizeof(filename), CONFIG_BSP_SPIFFS_MOUNT_POINT "%s%s", asset->path, variant ? ".gz" : "");
+#if CONFIG_PORTAL_CACHE_SIZE > 0
+        // Hot assets come from RAM, in one send
+        body->cached = portal_cache_get(filename, variant ? asset->gz_size : asset->size);
+        if (body->cached) {
+            body->gzipped = variant;
+            body->data = body->cached->data;
+            body->len = body->cached->len;
+            return ESP_OK;
+        }
+#endif
+        body->fp = fopen(filename, "rb");
+        if (body->fp) {
+            body->gzipped = variant;
+            return ESP_OK;
+        }
+    }
+    ESP_LOGE(TAG, "Failed to open file %s", filename);
+    return ESP_ERR_NOT_FOUND;
+}
 
-    ESP_GOTO_ON_FALSE(feof(fp), ESP_FAIL, err, TAG, "Failed to read file %s error: %d", filename, ferror(fp));
-
-    // chunks send finish
-    httpd_resp_send_chunk(req, NULL, 0);
-
-    err:
-    if (fp != NULL) {
-        fclose(fp);
+static void asset_body_close(asset_body_t *body)
+{
+#if CONFIG_PORTAL_CACHE_SIZE > 0
+    portal_cache_release(body->cached);
+#endif
+    if (body->fp) {
+        fclose(body->fp);
     }
-    if (buf != NULL) {
-        free(buf);
+}
+
+// Sends the body as response chunks, the last empty chunk is left to the caller
+static esp_err_t asset_body_send_chunks(httpd_req_t *req, asset_body_t *body)
+{
+    if (body->data) {
+        return httpd_resp_send_chunk(req, body->data, body->len);
     }
 
-    if (ret == ESP_ERR_NOT_FOUND) {
-        ret = httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+    esp_err_t ret = ESP_OK;
+    size_t read_len = 0;
+    char *buf = malloc(HTML_BUF_SIZE);
+    ESP_RETURN_ON_FALSE(buf, ESP_ERR_NO_MEM, TAG, "Failed to allocate memory for buf");
+    while (ret == ESP_OK && (read_len = fread(buf, sizeof(char), HTML_BUF_SIZE, body->fp)) > 0) {
+        ret = httpd_resp_send_chunk(req, buf, read_len);
     }
+    ESP_GOTO_ON_FALSE(ret != ESP_OK || feof(body->fp), ESP_FAIL, end, TAG, "Failed to read file, error: %d", ferror(body->fp));
 
+    end:
+    free(buf);
     return ret;
 }
 
-static esp_err_t scan_get_handler(httpd_req_t *req)
+static esp_err_t send_file_response(httpd_req_t *req, const portal_asset_t *asset)
 {
     esp_err_t ret = ESP_OK;
-    uint16_t number = 10;
-    uint16_t size = number * sizeof(wifi_ap_record_t);
-    wifi_ap_record_t *ap_info = malloc(number * sizeof(wifi_ap_record_t));
-    uint16_t ap_count = 0;
-    char *resp = NULL;
-    char json_obj[128];
-    uint16_t resp_buf_len;
+    char etag[24];
+    asset_body_t body;
+
+    // Text assets have a pre-compressed variant in the image, see tools/portal_assets.py
+    bool want_gzip = asset->gz_size > 0 && client_accepts_gzip(req);
+    if (asset_body_open(asset, want_gzip, true, &body) != ESP_OK) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
+    }
 
-    memset(ap_info, 0, size);
+    // Both encodings are different representations, they need different strong ETags: the one actually sent.
+    // Revalidated by the content hash, the body is only opened, never read for a 304
+    snprintf(etag, sizeof(etag), "\"%s%s\"", asset->version, body.gzipped ? "-gz" : "");
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", request_is_versioned(req, asset) ?
+                       "public, max-age=31536000, immutable" : "no-cache");
+    if (asset->gz_size > 0) {
+        httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    }
 
-    ESP_GOTO_ON_ERROR(wifi_scan(number, ap_info, &ap_count), end, TAG, "wifi_scan failed");
+    if (etag_matches(req, etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        ret = httpd_resp_send(req, NULL, 0);
+        goto end;
+    }
 
-    httpd_resp_set_type(req, "text/html");
+    set_content_type(req, asset->path);
+    if (body.gzipped) {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    if (body.data) {
+        ret = httpd_resp_send(req, body.data, body.len);
+        goto end;
+    }
+    ret = asset_body_send_chunks(req, &body);
+    if (ret == ESP_OK) {
+        // chunks send finish
+        ret = httpd_resp_send_chunk(req, NULL, 0);
+    }
 
-    if (ap_count > 0) {
-        resp_buf_len = ap_count * (sizeof(ap_info->ssid) + 22);
-        resp = malloc(resp_buf_len);
-        memset(resp, 0, resp_buf_len);
+    end:
+    asset_body_close(&body);
+    return ret;
+}
 
-        resp[0] = '[';
+#define SCAN_WAIT_MS 10000
 
-        int resp_len = 1;
-        for (int i = 0; (i < number) && (i < ap_count); i++) {
-            resp_len += sprintf(json_obj, "{\"ssid\":\"%s\", \"rssi\":%d}", ap_info[i].ssid, ap_info[i].rssi);
-            if (i > 0) {
-                strcat(resp, ",");
-                resp_len += 1;
-            }
-            strcat(resp, json_obj);
+// "?fresh=1" asks for the result of a scan started after the request rather than the cached one
+static bool scan_request_fresh(httpd_req_t *req)
+{
+    char query[32];
+    char value[4];
+    return httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+           httpd_query_key_value(query, "fresh", value, sizeof(value)) == ESP_OK &&
+           strcmp(value, "1") == 0;
+}
+
+// json_generator does not escape strings, this does for one SSID: quotes, backslashes and control characters,
+// and '<' so that no SSID can end the script the portal page renders the results into
+static void json_escape_ssid(const uint8_t *ssid, size_t ssid_len, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < ssid_len && ssid[i]; i++) {
+        if (ssid[i] == '"' || ssid[i] == '\\') {
+            *out++ = '\\';
+            *out++ = ssid[i];
+        } else if (ssid[i] < 0x20 || ssid[i] == '<') {
+            out += sprintf(out, "\\u00%c%c", hex[ssid[i] >> 4], hex[ssid[i] & 0xf]);
+        } else {
+            *out++ = ssid[i];
         }
-        strcat(resp, "]");
-//        resp[resp_len+1] = '\0';
-        resp_len += 1;
-        ESP_LOGD(TAG, "resp: %s", resp);
-        ESP_RETURN_ON_ERROR(httpd_resp_send(req, resp, resp_len), TAG, "send response failed");
-        free(resp);
-    } else {
-        ESP_RETURN_ON_ERROR(httpd_resp_sendstr(req, "[]"), TAG, "send response failed");
     }
+    *out = '\0';
+}
 
-    end:
-    free(ap_info);
+typedef struct {
+    httpd_req_t *req;
+    esp_err_t err;
+    // Continuing the portal page's open gzip stream: every write becomes a stored deflate block
+    bool gzip;
+    uint32_t crc;
+    uint32_t size;
+} scan_stream_t;
 
-    return ret;
+static void scan_stream_write(scan_stream_t *stream, const char *data, size_t len, bool final)
+{
+    if (stream->err != ESP_OK) {
+        return;
+    }
+    if (stream->gzip) {
+        // Byte aligned, the page's deflate data ends with a sync flush; BFINAL, BTYPE 00, LEN, NLEN
+        uint8_t header[5] = { final, len & 0xff, len >> 8, ~len & 0xff, (~len >> 8) & 0xff };
+        stream->crc = esp_rom_crc32_le(stream->crc, (const uint8_t *)data, len);
+        stream->size += len;
+        stream->err = httpd_resp_send_chunk(stream->req, (const char *)header, sizeof(header));
+        if (stream->err != ESP_OK) {
+            return;
+        }
+    }
+    if (len > 0) {
+        stream->err = httpd_resp_send_chunk(stream->req, data, len);
+    }
+}
+
+// Called by json_generator whenever its buffer is full and at the end, sends it out as one chunk
+static void scan_stream_flush(char *buf, void *priv)
+{
+    size_t len = strlen(buf);
+    if (len > 0) {
+        scan_stream_write(priv, buf, len, false);
+    }
+}
+
+// Memory use does not depend on the number of APs: the JSON streams out through a small buffer
+static void scan_stream_json(scan_stream_t *stream, const wifi_scan_snapshot_t *snapshot)
+{
+    char buf[256];
+    // Every SSID byte may take \u00XX
+    char ssid[sizeof(((wifi_ap_record_t *)0)->ssid) * 6 + 1];
+    json_gen_str_t jstr;
+
+    json_gen_str_start(&jstr, buf, sizeof(buf), scan_stream_flush, stream);
+    json_gen_start_array(&jstr);
+    for (int i = 0; snapshot && i < snapshot->ap_count && stream->err == ESP_OK; i++) {
+        json_escape_ssid(snapshot->ap[i].ssid, sizeof(snapshot->ap[i].ssid), ssid);
+        json_gen_start_object(&jstr);
+        json_gen_obj_set_string(&jstr, "ssid", ssid);
+        json_gen_obj_set_int(&jstr, "rssi", snapshot->ap[i].rssi);
+        json_gen_end_object(&jstr);
+    }
+    json_gen_end_array(&jstr);
+    json_gen_str_end(&jstr);
+}
+
+static esp_err_t scan_get_handler(httpd_req_t *req)
+{
+    // May wait for a scan
+    if (!portal_async_on_worker()) {
+        return portal_async_submit(req, scan_get_handler);
+    }
+
+    char age[12];
+    scan_stream_t stream = {.req = req, .err = ESP_OK};
+
+    wifi_scan_snapshot_t *snapshot = wifi_scan_get(scan_request_fresh(req), pdMS_TO_TICKS(SCAN_WAIT_MS));
+
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    if (snapshot) {
+        snprintf(age, sizeof(age), "%d", (int)((esp_timer_get_time() - snapshot->timestamp_us) / 1000000));
+        httpd_resp_set_hdr(req, "Age", age);
+    }
+
+    scan_stream_json(&stream, snapshot);
+    wifi_scan_release(snapshot);
+
+    ESP_RETURN_ON_ERROR(stream.err, TAG, "send response failed");
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 static esp_err_t root_get_handler(httpd_req_t *req)
@@ -140,124 +406,338 @@ static esp_err_t root_get_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
-void url_decode(char *src) {
-    char *dst = src;
-    char a, b;
-
-    while (*src) {
-        if ((*src == '%') &&
-            ((a = src[1]) && (b = src[2])) &&
-            (isxdigit((uint8_t)a) && isxdigit((uint8_t)b))) {
-            if (a >= 'a')
-                a -= 'a' - 'A';
-            if (a >= 'A')
-                a -= ('A' - 10);
-            else
-                a -= '0';
-            if (b >= 'a')
-                b -= 'a' - 'A';
-            if (b >= 'A')
-                b -= ('A' - 10);
-            else
-                b -= '0';
-            *dst++ = 16 * a + b;
-            src += 3;
-        } else if (*src == '+') {
-            *dst++ = ' ';
-            src++;
-        } else {
-            *dst++ = *src++;
+/*
+ * Connectivity probes of the common OSes. Until the station is online every probe is redirected to the portal,
+ * afterwards it gets the answer its OS expects from the real internet, so the phone stops probing and
+ * drops the captive portal sheet. Both answers are constant, nothing is looked up per request
+ */
+typedef struct {
+    const char *uri;
+    const char *status;         // once online
+    const char *type;           // once online, NULL without a body
+    const char *body;
+} captive_probe_t;
+
+#define APPLE_PROBE_SUCCESS "<HTML><HEAD><TITLE>Success</TITLE></HEAD><BODY>Success</BODY></HTML>"
+
+static const captive_probe_t captive_probes[] = {
+        // Android, ChromeOS
+        { "/generate_204", "204 No Content", NULL, NULL },
+        { "/generate204", "204 No Content", NULL, NULL },
+        // iOS, macOS
+        { "/hotspot-detect.html", "200 OK", "text/html", APPLE_PROBE_SUCCESS },
+        { "/library/test/success.html", "200 OK", "text/html", APPLE_PROBE_SUCCESS },
+        // Windows
+        { "/connecttest.txt", "200 OK", "text/plain", "Microsoft Connect Test" },
+        { "/ncsi.txt", "200 OK", "text/plain", "Microsoft NCSI" },
+        // Firefox
+        { "/success.txt", "200 OK", "text/plain", "success\n" },
+};
+
+#define CAPTIVE_PROBES_COUNT (sizeof(captive_probes) / sizeof(captive_probes[0]))
+
+static esp_err_t probe_get_handler(httpd_req_t *req)
+{
+    const captive_probe_t *probe = req->user_ctx;
+
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    if (!app_wifi_is_connected()) {
+        httpd_resp_set_status(req, "302 Temporary Redirect");
+        httpd_resp_set_hdr(req, "Location", "/config");
+        // iOS requires content in the response to detect a captive portal, simply redirecting is not sufficient.
+        return httpd_resp_sendstr(req, "Redirect to the captive portal");
+    }
+
+    httpd_resp_set_status(req, probe->status);
+    if (probe->body == NULL) {
+        return httpd_resp_send(req, NULL, 0);
+    }
+    httpd_resp_set_type(req, probe->type);
+    return httpd_resp_sendstr(req, probe->body);
+}
+
+// RFC 8908 API: tells clients whether they are still captive and where the portal page is
+static esp_err_t captive_api_get_handler(httpd_req_t *req)
+{
+    esp_netif_ip_info_t ip_info = { 0 };
+    esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ip_info);
+
+    char resp[96];
+    int len = snprintf(resp, sizeof(resp), "{\"captive\":%s,\"user-portal-url\":\"http://" IPSTR "/config\"}",
+                       app_wifi_is_connected() ? "false" : "true", IP2STR(&ip_info.ip));
+
+    httpd_resp_set_type(req, "application/captive+json");
+    httpd_resp_set_hdr(req, "Cache-Control", "private, no-store");
+    return httpd_resp_send(req, resp, len);
+}
+
+// Sends exactly this variant of an asset as response chunks: from the bundle, the RAM cache or SPIFFS
+static esp_err_t send_asset_chunks(httpd_req_t *req, const portal_asset_t *asset, bool gz)
+{
+    asset_body_t body;
+    ESP_RETURN_ON_ERROR(asset_body_open(asset, gz, false, &body), TAG, "No %s variant of %s", gz ? "gzipped" : "plain", asset->path);
+    esp_err_t ret = asset_body_send_chunks(req, &body);
+    asset_body_close(&body);
+    return ret;
+}
+
+/*
+ * The portal page with the latest scan results rendered in, no /scan round trip before the list shows. Its script
+ * and critical styles are inlined at build time, so first paint needs this one response; the rest of the stylesheet
+ * is a versioned asset loaded afterwards.
+ * The image holds the page up to the scan results, the rest follows here. Gzipped, the stored part is a gzip stream
+ * left open behind a sync flush (see tools/portal_assets.py); the results and the end of the page continue it
+ * as stored blocks and the trailer's CRC carries on from the one the manifest has for the stored part
+ */
+static esp_err_t send_portal_page(httpd_req_t *req)
+{
+    const portal_asset_t *page = portal_asset_find(PORTAL_PAGE_PATH);
+    ESP_RETURN_ON_FALSE(page, httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist"), TAG, "No portal page");
+
+    scan_stream_t stream = {
+            .req = req,
+            .err = ESP_OK,
+            .gzip = page->gz_size > 0 && client_accepts_gzip(req),
+            .crc = PORTAL_PAGE_CRC,
+            .size = page->size,
+    };
+
+    httpd_resp_set_type(req, "text/html");
+    // Rendered per request
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (stream.gzip) {
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    ESP_RETURN_ON_ERROR(send_asset_chunks(req, page, stream.gzip), TAG, "Failed to send the portal page");
+
+    // No waiting: without results yet the page fetches /scan itself
+    wifi_scan_snapshot_t *snapshot = wifi_scan_get(false, 0);
+    scan_stream_json(&stream, snapshot);
+    wifi_scan_release(snapshot);
+    scan_stream_write(&stream, PORTAL_PAGE_SUFFIX, strlen(PORTAL_PAGE_SUFFIX), true);
+
+    if (stream.gzip && stream.err == ESP_OK) {
+        uint8_t trailer[8];
+        for (int i = 0; i < 4; i++) {
+            trailer[i] = stream.crc >> (8 * i);
+            trailer[4 + i] = stream.size >> (8 * i);
         }
+        stream.err = httpd_resp_send_chunk(req, (const char *)trailer, sizeof(trailer));
     }
-    *dst = '\0';
+    ESP_RETURN_ON_ERROR(stream.err, TAG, "send response failed");
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 // HTTP Save Handler
 static esp_err_t config_get_handler(httpd_req_t *req)
 {
     // default response
-    char index_filename[] = CONFIG_BSP_SPIFFS_MOUNT_POINT "/index.html";
-    return send_file_response(req, index_filename);
+    return send_portal_page(req);
 }
 
-static void async_wifi_connect(void* arg)
-{
-    ESP_ERROR_CHECK(esp_wifi_stop());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
-    ESP_ERROR_CHECK(esp_wifi_start());
-    // wifi connect will be auto called after start
-    // see app_wifi event handler function.
-    // ESP_ERROR_CHECK(esp_wifi_connect());
+#define SAVE_MAX_BODY_LEN 512
+// The whole body has to arrive within this, a stalled client must not keep an async worker
+#define SAVE_RECV_DEADLINE_US (10 * 1000 * 1000)
 
-    vTaskDelete(NULL);
+static bool content_type_is(httpd_req_t *req, const char *type)
+{
+    char value[48];
+    if (httpd_req_get_hdr_value_str(req, "Content-Type", value, sizeof(value)) != ESP_OK) {
+        return false;
+    }
+    // Parameters like "; charset=UTF-8" may follow
+    size_t len = strlen(type);
+    return strncasecmp(value, type, len) == 0 && (value[len] == '\0' || value[len] == ';' || value[len] == ' ');
 }
 
-static esp_err_t save_get_handler(httpd_req_t *req)
+/*
+ * POST /save with {"ssid": ..., "password": ...} as a JSON object or urlencoded.
+ * The body is parsed as it is received, the values decode straight into the station config
+ */
+static esp_err_t save_post_handler(httpd_req_t *req)
 {
+    // Writes to flash
+    if (!portal_async_on_worker()) {
+        return portal_async_submit(req, save_post_handler);
+    }
+
+    portal_form_type_t type;
+    if (content_type_is(req, "application/json")) {
+        type = PORTAL_FORM_JSON;
+    } else if (content_type_is(req, "application/x-www-form-urlencoded")) {
+        type = PORTAL_FORM_URLENCODED;
+    } else {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "不支持的Content-Type");
+    }
+    if (req->content_len > SAVE_MAX_BODY_LEN) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "参数错误");
+    }
+
+    wifi_config_t wifi_cfg = {};
+    portal_form_field_t fields[] = {
+            PORTAL_FORM_FIELD("ssid", wifi_cfg.sta.ssid),
+            PORTAL_FORM_FIELD("password", wifi_cfg.sta.password),
+    };
+    portal_form_parser_t parser;
+    portal_form_init(&parser, type, fields, sizeof(fields) / sizeof(fields[0]));
+
+    char chunk[64];
+    size_t remaining = req->content_len;
     esp_err_t ret = ESP_OK;
-    char *buf = NULL;
-    size_t buf_len;
-
-    // request with params
-    buf_len = httpd_req_get_url_query_len(req) + 1;
-    if (buf_len > 1) {
-        buf = calloc(buf_len, sizeof(char));
-        if (httpd_req_get_url_query_str(req, buf, buf_len) == ESP_OK) {
-            ESP_LOGI(TAG, "Found URL query => %s", buf);
-            char param[65] = {0};
-            char wifi_ssid[33] = {0};
-            char wifi_password[65] = {0};
-
-            wifi_config_t wifi_cfg = {};
-
-            if (httpd_query_key_value(buf, "ssid", param, sizeof(param)) == ESP_OK) {
-                url_decode(param);
-                ESP_LOGI(TAG, "ssid=%s", param);
-                strncpy(wifi_ssid, param, sizeof(wifi_ssid));
+    int64_t deadline = esp_timer_get_time() + SAVE_RECV_DEADLINE_US;
+    while (remaining > 0 && ret == ESP_OK) {
+        int received = httpd_req_recv(req, chunk, MIN(remaining, sizeof(chunk)));
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            if (esp_timer_get_time() < deadline) {
+                continue;
             }
+            ESP_LOGW(TAG, "Request body stalled, %u bytes missing", (unsigned)remaining);
+            return httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, "Request body timed out");
+        }
+        if (received <= 0) {
+            // Connection gone, nobody to answer
+            return ESP_FAIL;
+        }
+        remaining -= received;
+        ret = portal_form_feed(&parser, chunk, received);
+    }
+    if (ret == ESP_OK) {
+        ret = portal_form_finish(&parser);
+    }
+    memset(chunk, 0, sizeof(chunk));
 
-            if (httpd_query_key_value(buf, "password", param, sizeof(param)) == ESP_OK) {
-                url_decode(param);
-                ESP_LOGI(TAG, "password=%s", param);
-                strncpy(wifi_password, param, sizeof(wifi_password));
-            }
+    if (ret != ESP_OK || fields[0].len == 0 || fields[1].len == 0) {
+        ESP_LOGW(TAG, "WiFi settings rejected: %s", esp_err_to_name(ret));
+        memset(&wifi_cfg, 0, sizeof(wifi_cfg));
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "参数错误");
+    }
 
-            if (strlen(wifi_ssid) > 0 && strlen(wifi_password)) {
-                ESP_LOGI(TAG, "WiFi settings accepted!");
-                strncpy((char *)wifi_cfg.sta.ssid, wifi_ssid, sizeof(wifi_cfg.sta.ssid));
-                strncpy((char *)wifi_cfg.sta.password, wifi_password, sizeof(wifi_cfg.sta.password));
+    ESP_LOGI(TAG, "WiFi settings accepted for SSID %.*s", (int)fields[0].len, wifi_cfg.sta.ssid);
+    httpd_resp_set_type(req, "text/html");
+    if (esp_wifi_set_storage(WIFI_STORAGE_FLASH) == ESP_OK &&
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg) == ESP_OK) {
+        ESP_LOGI(TAG, "WiFi settings applied and stored to flash");
+        ret = httpd_resp_sendstr(req, "ok");
+        app_wifi_connect();
+    } else {
+        ESP_LOGE(TAG, "Failed to set WiFi config to flash");
+        ret = httpd_resp_sendstr(req, "Failed to configure WiFi settings");
+    }
+    memset(&wifi_cfg, 0, sizeof(wifi_cfg));
 
-                httpd_resp_set_type(req, "text/html");
-                if (esp_wifi_set_storage(WIFI_STORAGE_FLASH) == ESP_OK &&
-                    esp_wifi_set_config(WIFI_IF_STA, &wifi_cfg) == ESP_OK) {
-                    ESP_LOGI(TAG, "WiFi settings applied and stored to flash");
+    return ret;
+}
 
-                    ret = httpd_resp_sendstr(req, "ok");
+/*
+ * /ws: the page learns how the connection attempt started by /save goes. The server only talks,
+ * every change is pushed to all connected pages and a page connecting later gets the latest state first
+ */
+#define WS_STATE_MAX_LEN 64
 
-                    xTaskCreate(async_wifi_connect, "app_wifi_connect", 4096, NULL, 5, NULL);
+typedef struct {
+    size_t len;
+    char text[WS_STATE_MAX_LEN];
+} ws_state_msg_t;
 
-                } else {
-                    ESP_LOGE(TAG, "Failed to set WiFi config to flash");
-                    ret = httpd_resp_sendstr(req, "Failed to configure WiFi settings");
-                }
-            } else {
-                ESP_LOGW(TAG, "WiFi settings rejected!");
-                ret = ESP_ERR_INVALID_ARG;
-            }
-        } else {
-            ret = ESP_ERR_INVALID_ARG;
+typedef struct {
+    httpd_handle_t server;      // valid while the work runs: httpd_stop() waits for the server task
+    ws_state_msg_t state;
+} ws_push_t;
+
+// Only touched from the server task
+static ws_state_msg_t s_ws_state;
+
+static const char *wifi_state_name(captive_portal_wifi_state_t state)
+{
+    switch (state) {
+        case CAPTIVE_PORTAL_WIFI_CONNECTING:
+            return "connecting";
+        case CAPTIVE_PORTAL_WIFI_GOT_IP:
+            return "got-ip";
+        case CAPTIVE_PORTAL_WIFI_AUTH_FAIL:
+            return "auth-fail";
+        case CAPTIVE_PORTAL_WIFI_NOT_FOUND:
+            return "not-found";
+        default:
+            return "disconnected";
+    }
+}
+
+static esp_err_t ws_send_state(httpd_handle_t hd, int fd)
+{
+    httpd_ws_frame_t frame = {
+            .final = true,
+            .type = HTTPD_WS_TYPE_TEXT,
+            .payload = (uint8_t *)s_ws_state.text,
+            .len = s_ws_state.len,
+    };
+    return httpd_ws_send_frame_async(hd, fd, &frame);
+}
+
+// Runs in the server task, queued by captive_portal_push_wifi_state()
+static void ws_push_work(void *arg)
+{
+    ws_push_t *push = arg;
+    httpd_handle_t hd = push->server;
+    s_ws_state = push->state;
+    free(push);
+
+    size_t fds = CONFIG_LWIP_MAX_SOCKETS;
+    int client_fds[CONFIG_LWIP_MAX_SOCKETS];
+    if (httpd_get_client_list(hd, &fds, client_fds) != ESP_OK) {
+        return;
+    }
+    for (int i = 0; i < fds; i++) {
+        if (httpd_ws_get_fd_info(hd, client_fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET) {
+            ESP_ERROR_CHECK_WITHOUT_ABORT(ws_send_state(hd, client_fds[i]));
         }
-        free(buf);
+    }
+}
+
+void captive_portal_push_wifi_state(captive_portal_wifi_state_t state, const char *ip)
+{
+    if (s_server_lock == NULL) {
+        return;
+    }
+    ws_push_t *push = malloc(sizeof(ws_push_t));
+    if (push == NULL) {
+        return;
+    }
+    ws_state_msg_t *msg = &push->state;
+    if (ip) {
+        msg->len = snprintf(msg->text, sizeof(msg->text), "{\"state\":\"%s\",\"ip\":\"%s\"}", wifi_state_name(state), ip);
     } else {
-        ret = ESP_ERR_INVALID_ARG;
+        msg->len = snprintf(msg->text, sizeof(msg->text), "{\"state\":\"%s\"}", wifi_state_name(state));
+    }
+    ESP_LOGI(TAG, "Wi-Fi state: %s", msg->text);
+
+    // Queued under the lock: stop_captive_portal() clears server under it before stopping the server
+    xSemaphoreTake(s_server_lock, portMAX_DELAY);
+    push->server = server;
+    if (server == NULL || httpd_queue_work(server, ws_push_work, push) != ESP_OK) {
+        free(push);
     }
+    xSemaphoreGive(s_server_lock);
+}
 
-    if (ret == ESP_ERR_INVALID_ARG) {
-        ret = httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "参数错误");
+static esp_err_t ws_handler(httpd_req_t *req)
+{
+    if (req->method == HTTP_GET) {
+        // Handshake done, bring the new page up to date
+        if (s_ws_state.len > 0) {
+            ESP_ERROR_CHECK_WITHOUT_ABORT(ws_send_state(req->handle, httpd_req_to_sockfd(req)));
+        }
+        return ESP_OK;
     }
 
-    return ret;
+    // Nothing is expected from the page, whatever it sends is read and dropped
+    uint8_t buf[32];
+    httpd_ws_frame_t frame = {0};
+    ESP_RETURN_ON_ERROR(httpd_ws_recv_frame(req, &frame, 0), TAG, "ws frame length failed");
+    ESP_RETURN_ON_FALSE(frame.len <= sizeof(buf), ESP_ERR_INVALID_SIZE, TAG, "ws frame too long");
+    frame.payload = buf;
+    return httpd_ws_recv_frame(req, &frame, frame.len);
 }
 
 static const httpd_uri_t root_action = {
@@ -266,18 +746,6 @@ static const httpd_uri_t root_action = {
         .handler = root_get_handler
 };
 
-static const httpd_uri_t generate_204_action = {
-        .uri = "/generate_204",
-        .method = HTTP_GET,
-        .handler = root_get_handler
-};
-
-static const httpd_uri_t generate204_action = {
-        .uri = "/generate204",
-        .method = HTTP_GET,
-        .handler = root_get_handler
-};
-
 static const httpd_uri_t config_action = {
         .uri = "/config",
         .method = HTTP_GET,
@@ -286,8 +754,14 @@ static const httpd_uri_t config_action = {
 
 static const httpd_uri_t save_action = {
         .uri = "/save",
+        .method = HTTP_POST,
+        .handler = save_post_handler
+};
+
+static const httpd_uri_t captive_api_action = {
+        .uri = CAPTIVE_PORTAL_API_URI,
         .method = HTTP_GET,
-        .handler = save_get_handler
+        .handler = captive_api_get_handler
 };
 
 static const httpd_uri_t wifi_scan_action = {
@@ -296,39 +770,171 @@ static const httpd_uri_t wifi_scan_action = {
         .handler = scan_get_handler
 };
 
+static const httpd_uri_t metrics_action = {
+        .uri = PORTAL_METRICS_URI,
+        .method = HTTP_GET,
+        .handler = portal_metrics_get_handler
+};
+
+static const httpd_uri_t ws_action = {
+        .uri = "/ws",
+        .method = HTTP_GET,
+        .handler = ws_handler,
+        .is_websocket = true
+};
+
+// The DNS server's numbers go out on /metrics with the routes'
+static void dns_metrics_collector(portal_metrics_stream_t *stream, void *arg)
+{
+    static const uint32_t bounds_us[DNS_SERVER_LATENCY_BUCKETS - 1] = DNS_SERVER_LATENCY_BOUNDS_US;
+    dns_server_stats_t *stats = malloc(sizeof(dns_server_stats_t));
+    if (stats == NULL || s_dns_server == NULL || dns_server_get_stats(s_dns_server, stats) != ESP_OK) {
+        free(stats);
+        return;
+    }
+    const struct {
+        const char *name;
+        uint32_t value;
+    } counters[] = {
+            {"queries",           stats->queries},
+            {"answers",           stats->answers},
+            {"tcp_queries",       stats->tcp_queries},
+            {"drops",             stats->drops},
+            {"parse_failures",    stats->parse_failures},
+            {"rate_limited",      stats->rate_limited},
+            {"errors",            stats->errors},
+            {"forwarded",         stats->forwarded},
+            {"coalesced",         stats->coalesced},
+            {"cache_hits",        stats->cache_hits},
+            {"cache_misses",      stats->cache_misses},
+            {"upstream_timeouts", stats->upstream_timeouts},
+    };
+    for (int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        portal_metrics_printf(stream, "# TYPE portal_dns_%s_total counter\nportal_dns_%s_total %" PRIu32 "\n",
+                              counters[i].name, counters[i].name, counters[i].value);
+    }
+    portal_metrics_printf(stream, "# TYPE portal_dns_questions_total counter\n"
+                          "portal_dns_questions_total{type=\"A\"} %" PRIu32 "\n"
+                          "portal_dns_questions_total{type=\"AAAA\"} %" PRIu32 "\n"
+                          "portal_dns_questions_total{type=\"HTTPS\"} %" PRIu32 "\n"
+                          "portal_dns_questions_total{type=\"other\"} %" PRIu32 "\n",
+                          stats->type_a, stats->type_aaaa, stats->type_https, stats->type_other);
+
+    // Service time buckets have exclusive upper bounds, close enough for le
+    uint32_t cumulative = 0;
+    portal_metrics_printf(stream, "# TYPE portal_dns_service_seconds histogram\n");
+    for (int i = 0; i < DNS_SERVER_LATENCY_BUCKETS - 1; i++) {
+        cumulative += stats->latency_hist[i];
+        portal_metrics_printf(stream, "portal_dns_service_seconds_bucket{le=\"%" PRIu32 ".%06" PRIu32 "\"} %" PRIu32 "\n",
+                              bounds_us[i] / 1000000, bounds_us[i] % 1000000, cumulative);
+    }
+    cumulative += stats->latency_hist[DNS_SERVER_LATENCY_BUCKETS - 1];
+    portal_metrics_printf(stream, "portal_dns_service_seconds_bucket{le=\"+Inf\"} %" PRIu32 "\n"
+                          "portal_dns_service_seconds_count %" PRIu32 "\n", cumulative, cumulative);
+    free(stats);
+}
+
+void captive_portal_set_dns_server(dns_server_handle_t dns_server)
+{
+    s_dns_server = dns_server;
+}
+
 // HTTP Error (404) Handler - Redirects all requests to the root page
 esp_err_t http_404_error_handler(httpd_req_t *req, httpd_err_code_t err)
 {
-    char filename[HTTPD_MAX_URI_LEN+10];
-    sprintf(filename, CONFIG_BSP_SPIFFS_MOUNT_POINT "%s", req->uri);
-
-    return send_file_response(req, filename);
+    // Only assets of the image are served, whatever else a client probes for goes to the portal page
+    const portal_asset_t *asset = portal_asset_find(req->uri);
+    if (asset == NULL) {
+        return root_get_handler(req);
+    }
+    // Only the first part of the page is a file
+    if (strcmp(asset->path, PORTAL_PAGE_PATH) == 0) {
+        return send_portal_page(req);
+    }
+    return send_file_response(req, asset);
 }
 
 httpd_handle_t start_captive_portal(void)
 {
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_open_sockets = CONFIG_LWIP_MAX_SOCKETS - 3;
+    // Leave room for the DNS server running next to the portal
+    config.max_open_sockets = CONFIG_LWIP_MAX_SOCKETS - 3 - DNS_SERVER_MAX_SOCKETS;
     config.lru_purge_enable = true;
     config.max_resp_headers = 20;
+    // The portal's own routes plus the OS connectivity probes
+    config.max_uri_handlers = 8 + CAPTIVE_PROBES_COUNT;
+
+    if (s_server_lock == NULL) {
+        s_server_lock = xSemaphoreCreateMutex();
+        ESP_RETURN_ON_FALSE(s_server_lock, NULL, TAG, "Failed to create the server lock");
+    }
+    portal_cache_init();
+    portal_metrics_init();
+    portal_metrics_add_collector(dns_metrics_collector, NULL);
+#if CONFIG_PORTAL_ASSETS_BUNDLE
+    if (portal_assets_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Asset bundle unavailable, serving assets from SPIFFS");
+    } else {
+#if CONFIG_PORTAL_ASSETS_BENCH
+        portal_assets_bench();
+#endif
+    }
+#endif
 
     // Start the httpd server
     ESP_LOGI(TAG, "Starting server on port: '%d'", config.server_port);
-    if (httpd_start(&server, &config) == ESP_OK) {
-        // Set URI handlers
+    httpd_handle_t handle = NULL;
+    if (httpd_start(&handle, &config) == ESP_OK) {
+        if (portal_async_start() != ESP_OK) {
+            ESP_LOGW(TAG, "No async workers, slow requests will be refused");
+        }
+        // Set URI handlers, each one's requests are counted and timed for /metrics
         ESP_LOGI(TAG, "Registering URI handlers");
-        httpd_register_uri_handler(server, &root_action);
-        httpd_register_uri_handler(server, &generate204_action);
-        httpd_register_uri_handler(server, &generate_204_action);
-        httpd_register_uri_handler(server, &config_action);
-        httpd_register_uri_handler(server, &save_action);
-        httpd_register_uri_handler(server, &wifi_scan_action);
-        httpd_register_err_handler(server, HTTPD_404_NOT_FOUND, http_404_error_handler);
+        portal_metrics_register_uri_handler(handle, &root_action);
+        for (int i = 0; i < CAPTIVE_PROBES_COUNT; i++) {
+            const httpd_uri_t probe_action = {
+                    .uri = captive_probes[i].uri,
+                    .method = HTTP_GET,
+                    .handler = probe_get_handler,
+                    .user_ctx = (void *)&captive_probes[i],
+            };
+            portal_metrics_register_uri_handler(handle, &probe_action);
+        }
+        portal_metrics_register_uri_handler(handle, &config_action);
+        portal_metrics_register_uri_handler(handle, &save_action);
+        portal_metrics_register_uri_handler(handle, &wifi_scan_action);
+        portal_metrics_register_uri_handler(handle, &captive_api_action);
+        portal_metrics_register_uri_handler(handle, &metrics_action);
+        portal_metrics_register_uri_handler(handle, &ws_action);
+        portal_metrics_register_err_handler(handle, HTTPD_404_NOT_FOUND, http_404_error_handler);
+
+        xSemaphoreTake(s_server_lock, portMAX_DELAY);
+        server = handle;
+        xSemaphoreGive(s_server_lock);
     }
-    return server;
+    return handle;
 }
 
 esp_err_t stop_captive_portal(void)
 {
-    return httpd_stop(server);
+    if (server == NULL) {
+        return ESP_OK;
+    }
+    portal_cache_stats_t cache_stats;
+    portal_cache_get_stats(&cache_stats);
+    ESP_LOGI(TAG, "Asset cache: %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " evictions",
+             cache_stats.hits, cache_stats.misses, cache_stats.evictions);
+    portal_cache_invalidate();
+
+    // Requests handed off still use the server
+    portal_async_stop();
+    // Nothing may queue work for the server once it is being stopped
+    xSemaphoreTake(s_server_lock, portMAX_DELAY);
+    httpd_handle_t handle = server;
+    server = NULL;
+    xSemaphoreGive(s_server_lock);
+    esp_err_t ret = httpd_stop(handle);
+    s_ws_state.len = 0;
+    s_dns_server = NULL;
+    return ret;
 }
\ No newline at end of file
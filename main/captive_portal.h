@@ -6,8 +6,35 @@
 #define ESP_FOLLOWME2_CAPTIVE_PORTAL_H
 
 #include "esp_http_server.h"
+#include "dns_server.h"
+
+// RFC 8908 captive portal API, advertised to softAP clients by DHCP option 114 with CONFIG_PORTAL_DHCP_CAPTIVE_URI
+#define CAPTIVE_PORTAL_API_URI "/captive-portal/api"
 
 httpd_handle_t start_captive_portal(void);
 esp_err_t stop_captive_portal(void);
 
+/**
+ * Hands the portal the DNS server running next to it, its statistics are published on /metrics.
+ * The DNS server has to outlive the portal: stop the portal first
+ */
+void captive_portal_set_dns_server(dns_server_handle_t dns_server);
+
+// Wi-Fi state changes the portal page follows over its /ws WebSocket
+typedef enum {
+    CAPTIVE_PORTAL_WIFI_CONNECTING,
+    CAPTIVE_PORTAL_WIFI_GOT_IP,
+    CAPTIVE_PORTAL_WIFI_AUTH_FAIL,
+    CAPTIVE_PORTAL_WIFI_NOT_FOUND,
+    CAPTIVE_PORTAL_WIFI_DISCONNECTED,
+} captive_portal_wifi_state_t;
+
+/**
+ * Pushes a Wi-Fi state change to every page connected to /ws, does nothing while the portal is not running.
+ * Safe to call from any task, the frames are sent from the portal's server task
+ * @param state the new state
+ * @param ip the station's IP address for CAPTIVE_PORTAL_WIFI_GOT_IP, NULL otherwise
+ */
+void captive_portal_push_wifi_state(captive_portal_wifi_state_t state, const char *ip);
+
 #endif //ESP_FOLLOWME2_CAPTIVE_PORTAL_H
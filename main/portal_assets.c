@@ -0,0 +1,114 @@
+//
+// Captive portal assets served straight from the memory-mapped "assets" partition
+//
+
+#include <inttypes.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_partition.h>
+#include "portal_assets.h"
+#include "portal_assets_manifest.h"
+
+static const char *TAG = "PORTAL_ASSETS";
+
+#define BUNDLE_PARTITION_LABEL "assets"
+#define BUNDLE_PARTITION_SUBTYPE 0x40
+#define BUNDLE_MAGIC 0x32424150     // "PAB2"
+#define BUNDLE_PATH_LEN 32
+
+// Bundle layout, little endian like the chip, see tools/portal_assets.py
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic;
+    uint16_t count;
+    uint16_t reserved;
+    uint32_t version;               // PORTAL_ASSETS_BUNDLE_VERSION of the build that packed it
+} bundle_header_t;
+
+typedef struct __attribute__((__packed__)) {
+    char path[BUNDLE_PATH_LEN];     // NUL padded
+    uint32_t offset;
+    uint32_t size;
+    uint32_t gz_offset;             // 0 with gz_size if there is no gzipped variant
+    uint32_t gz_size;
+} bundle_entry_t;
+
+static const char *s_bundle;
+static const bundle_entry_t *s_index;
+static uint16_t s_count;
+static esp_partition_mmap_handle_t s_mmap_handle;
+
+static bool bundle_blob_valid(uint32_t offset, uint32_t size, size_t bundle_size)
+{
+    return offset <= bundle_size && size <= bundle_size - offset;
+}
+
+esp_err_t portal_assets_init(void)
+{
+    if (s_bundle) {
+        return ESP_OK;
+    }
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, BUNDLE_PARTITION_SUBTYPE,
+                                                           BUNDLE_PARTITION_LABEL);
+    ESP_RETURN_ON_FALSE(part, ESP_ERR_NOT_FOUND, TAG, "No %s partition", BUNDLE_PARTITION_LABEL);
+
+    const void *mapped = NULL;
+    ESP_RETURN_ON_ERROR(esp_partition_mmap(part, 0, part->size, ESP_PARTITION_MMAP_DATA, &mapped, &s_mmap_handle),
+                        TAG, "Failed to map the asset bundle");
+
+    // Everything below only reads what the checks before proved to be inside the partition
+    esp_err_t ret = ESP_OK;
+    const bundle_header_t *header = mapped;
+    ESP_GOTO_ON_FALSE(part->size >= sizeof(bundle_header_t) && header->magic == BUNDLE_MAGIC,
+                      ESP_ERR_INVALID_STATE, err, TAG, "No asset bundle flashed");
+    // Only a full flash writes the partition: after an app-only update the bundle belongs to another build, and
+    // serving it under this build's versioned URLs would have clients keep the wrong assets
+    ESP_GOTO_ON_FALSE(header->version == PORTAL_ASSETS_BUNDLE_VERSION, ESP_ERR_INVALID_VERSION, err, TAG,
+                      "Asset bundle %08" PRIx32 " is not the one of this firmware (%08" PRIx32 ")",
+                      header->version, (uint32_t)PORTAL_ASSETS_BUNDLE_VERSION);
+    ESP_GOTO_ON_FALSE(sizeof(bundle_header_t) + header->count * sizeof(bundle_entry_t) <= part->size,
+                      ESP_ERR_INVALID_STATE, err, TAG, "Asset bundle index out of bounds");
+
+    const bundle_entry_t *index = (const bundle_entry_t *)(header + 1);
+    for (int i = 0; i < header->count; i++) {
+        ESP_GOTO_ON_FALSE(memchr(index[i].path, '\0', BUNDLE_PATH_LEN) &&
+                          bundle_blob_valid(index[i].offset, index[i].size, part->size) &&
+                          bundle_blob_valid(index[i].gz_offset, index[i].gz_size, part->size),
+                          ESP_ERR_INVALID_STATE, err, TAG, "Asset bundle entry %d out of bounds", i);
+    }
+
+    s_index = index;
+    s_count = header->count;
+    s_bundle = mapped;
+    ESP_LOGI(TAG, "Mapped %d assets from the %s partition", s_count, BUNDLE_PARTITION_LABEL);
+    return ESP_OK;
+
+err:
+    esp_partition_munmap(s_mmap_handle);
+    return ret;
+}
+
+void portal_assets_deinit(void)
+{
+    if (s_bundle) {
+        s_bundle = NULL;
+        s_index = NULL;
+        s_count = 0;
+        esp_partition_munmap(s_mmap_handle);
+    }
+}
+
+esp_err_t portal_assets_get(const char *path, bool accept_gzip, portal_asset_blob_t *blob)
+{
+    for (int i = 0; i < s_count; i++) {
+        const bundle_entry_t *entry = &s_index[i];
+        if (strncmp(entry->path, path, BUNDLE_PATH_LEN) != 0) {
+            continue;
+        }
+        blob->gzipped = accept_gzip && entry->gz_size > 0;
+        blob->data = s_bundle + (blob->gzipped ? entry->gz_offset : entry->offset);
+        blob->len = blob->gzipped ? entry->gz_size : entry->size;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,45 @@
+//
+// Captive portal assets served straight from the memory-mapped "assets" partition
+//
+
+#ifndef ESP_FOLLOWME2_PORTAL_ASSETS_H
+#define ESP_FOLLOWME2_PORTAL_ASSETS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef struct {
+    const char *data;       // points into mapped flash, valid until portal_assets_deinit()
+    size_t len;
+    bool gzipped;
+} portal_asset_blob_t;
+
+/**
+ * Maps the asset bundle written by tools/portal_assets.py and checks its index and that it was built along with this firmware
+ * @return ESP_OK, also if it was mapped already; ESP_ERR_NOT_FOUND without the partition, ESP_ERR_INVALID_STATE on a bad bundle,
+ *         ESP_ERR_INVALID_VERSION on a bundle of another build. Nothing stays mapped on errors
+ */
+esp_err_t portal_assets_init(void);
+
+/**
+ * Unmaps the bundle, pointers handed out before are no longer valid
+ */
+void portal_assets_deinit(void);
+
+/**
+ * Looks an asset up by its URI path
+ * @param path URI path, e.g. "/index.html"
+ * @param accept_gzip take the gzipped variant if there is one
+ * @param blob the asset's bytes
+ * @return ESP_OK, ESP_ERR_NOT_FOUND if the asset is not in the bundle or there is no bundle
+ */
+esp_err_t portal_assets_get(const char *path, bool accept_gzip, portal_asset_blob_t *blob);
+
+/**
+ * Logs how long serving every asset takes from SPIFFS and from the bundle, CONFIG_PORTAL_ASSETS_BENCH only.
+ * Needs the bundle mapped and SPIFFS mounted
+ */
+void portal_assets_bench(void);
+
+#endif //ESP_FOLLOWME2_PORTAL_ASSETS_H
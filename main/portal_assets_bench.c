@@ -0,0 +1,96 @@
+//
+// Serving an asset from SPIFFS versus from the memory-mapped bundle, measured on the device at portal start
+//
+// Both paths do what send_file_response() does before the socket: SPIFFS opens the file, allocates the read
+// buffer and reads it in chunks; the bundle looks the asset up and hands out the mapped bytes. Every byte is
+// summed in both, standing in for the copy into the socket, which also checks the bundle holds the same files.
+//
+
+#include "sdkconfig.h"
+
+#if CONFIG_PORTAL_ASSETS_BENCH
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include "portal_assets.h"
+#include "portal_assets_manifest.h"
+
+static const char *TAG = "PORTAL_ASSETS_BENCH";
+
+#define BENCH_ROUNDS 20
+#define BENCH_BUF_SIZE 2048     // HTML_BUF_SIZE of send_file_response()
+
+static uint32_t checksum(uint32_t sum, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        sum = sum * 31 + (uint8_t)data[i];
+    }
+    return sum;
+}
+
+// Returns the time taken in microseconds, -1 if the file cannot be read
+static int64_t bench_spiffs(const char *filename, uint32_t *sum)
+{
+    int64_t start = esp_timer_get_time();
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    char *buf = calloc(BENCH_BUF_SIZE, sizeof(char));
+    if (buf == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    size_t read_len;
+    *sum = 0;
+    while ((read_len = fread(buf, sizeof(char), BENCH_BUF_SIZE, fp)) > 0) {
+        *sum = checksum(*sum, buf, read_len);
+    }
+    free(buf);
+    fclose(fp);
+    return esp_timer_get_time() - start;
+}
+
+static int64_t bench_bundle(const char *path, bool gz, uint32_t *sum)
+{
+    int64_t start = esp_timer_get_time();
+    portal_asset_blob_t blob;
+    if (portal_assets_get(path, gz, &blob) != ESP_OK || blob.gzipped != gz) {
+        return -1;
+    }
+    *sum = checksum(0, blob.data, blob.len);
+    return esp_timer_get_time() - start;
+}
+
+void portal_assets_bench(void)
+{
+    ESP_LOGI(TAG, "%-24s %7s %10s %10s  (us per request, mean of %d)", "asset", "bytes", "spiffs", "bundle", BENCH_ROUNDS);
+    for (int i = 0; i < PORTAL_ASSETS_COUNT; i++) {
+        const portal_asset_t *asset = &portal_assets[i];
+        for (int gz = 0; gz <= (asset->gz_size > 0); gz++) {
+            char filename[sizeof(CONFIG_BSP_SPIFFS_MOUNT_POINT) + PORTAL_ASSET_PATH_MAX_LEN + sizeof(".gz")];
+            snprintf(filename, sizeof(filename), CONFIG_BSP_SPIFFS_MOUNT_POINT "%s%s", asset->path, gz ? ".gz" : "");
+
+            int64_t spiffs_us = 0, bundle_us = 0;
+            uint32_t spiffs_sum = 0, bundle_sum = 0;
+            for (int round = 0; round < BENCH_ROUNDS && spiffs_us >= 0 && bundle_us >= 0; round++) {
+                int64_t us = bench_spiffs(filename, &spiffs_sum);
+                spiffs_us = us < 0 ? -1 : spiffs_us + us;
+                us = bench_bundle(asset->path, gz, &bundle_sum);
+                bundle_us = us < 0 ? -1 : bundle_us + us;
+            }
+            if (spiffs_us < 0 || bundle_us < 0) {
+                ESP_LOGW(TAG, "%-24s missing from %s", filename, spiffs_us < 0 ? "SPIFFS" : "the bundle");
+                continue;
+            }
+            ESP_LOGI(TAG, "%-24s %7u %10" PRId64 " %10" PRId64 "%s", filename + sizeof(CONFIG_BSP_SPIFFS_MOUNT_POINT) - 1,
+                     (unsigned)(gz ? asset->gz_size : asset->size), spiffs_us / BENCH_ROUNDS, bundle_us / BENCH_ROUNDS,
+                     spiffs_sum == bundle_sum ? "" : "  contents differ");
+        }
+    }
+}
+
+#endif
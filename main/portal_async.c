@@ -0,0 +1,135 @@
+//
+// Worker pool the captive portal hands slow requests off to, so its server task keeps serving the others
+//
+// esp_http_server runs every handler in its single task. A handler expecting to block - waiting for a scan,
+// writing to flash - detaches the request with httpd_req_async_handler_begin() and queues it here.
+// Requests are only queued for a free worker: waiting in the queue would hold their sockets for nothing.
+//
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_check.h>
+#include "portal_async.h"
+#include "portal_metrics.h"
+
+static const char *TAG = "PORTAL_ASYNC";
+
+#define PORTAL_ASYNC_WORKERS 2
+#define PORTAL_ASYNC_STACK_SIZE 4096
+#define PORTAL_ASYNC_PRIORITY (tskIDLE_PRIORITY + 5)
+
+typedef struct {
+    httpd_req_t *req;               // NULL asks the worker to end
+    portal_async_handler_t handler;
+} portal_async_job_t;
+
+static QueueHandle_t s_jobs;
+static SemaphoreHandle_t s_idle_workers;    // counts the workers waiting for a job
+static SemaphoreHandle_t s_stopped;         // given by every worker on its way out
+static TaskHandle_t s_workers[PORTAL_ASYNC_WORKERS];
+
+static void portal_async_worker(void *arg)
+{
+    portal_async_job_t job;
+    while (true) {
+        xSemaphoreGive(s_idle_workers);
+        xQueueReceive(s_jobs, &job, portMAX_DELAY);
+        if (job.req == NULL) {
+            break;
+        }
+        ESP_LOGD(TAG, "Handling %s", job.req->uri);
+        portal_metrics_request_done(job.req, job.handler(job.req));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(httpd_req_async_handler_complete(job.req));
+    }
+    xSemaphoreGive(s_stopped);
+    vTaskDelete(NULL);
+}
+
+esp_err_t portal_async_start(void)
+{
+    if (s_jobs) {
+        return ESP_OK;
+    }
+    s_jobs = xQueueCreate(PORTAL_ASYNC_WORKERS, sizeof(portal_async_job_t));
+    s_idle_workers = xSemaphoreCreateCounting(PORTAL_ASYNC_WORKERS, 0);
+    s_stopped = xSemaphoreCreateCounting(PORTAL_ASYNC_WORKERS, 0);
+    ESP_RETURN_ON_FALSE(s_jobs && s_idle_workers && s_stopped, ESP_ERR_NO_MEM, TAG, "Failed to create the worker queue");
+
+    for (int i = 0; i < PORTAL_ASYNC_WORKERS; i++) {
+        ESP_RETURN_ON_FALSE(xTaskCreate(portal_async_worker, "portal_async", PORTAL_ASYNC_STACK_SIZE, NULL,
+                                        PORTAL_ASYNC_PRIORITY, &s_workers[i]) == pdPASS,
+                            ESP_ERR_NO_MEM, TAG, "Failed to start worker %d", i);
+    }
+    return ESP_OK;
+}
+
+void portal_async_stop(void)
+{
+    if (s_jobs == NULL) {
+        return;
+    }
+    // Behind whatever is queued already, every worker gets an end marker
+    portal_async_job_t stop = {0};
+    int workers = 0;
+    for (int i = 0; i < PORTAL_ASYNC_WORKERS; i++) {
+        if (s_workers[i]) {
+            xQueueSend(s_jobs, &stop, portMAX_DELAY);
+            workers++;
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        xSemaphoreTake(s_stopped, portMAX_DELAY);
+    }
+    for (int i = 0; i < PORTAL_ASYNC_WORKERS; i++) {
+        s_workers[i] = NULL;
+    }
+    vQueueDelete(s_jobs);
+    vSemaphoreDelete(s_idle_workers);
+    vSemaphoreDelete(s_stopped);
+    s_jobs = NULL;
+    s_idle_workers = NULL;
+    s_stopped = NULL;
+}
+
+bool portal_async_on_worker(void)
+{
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < PORTAL_ASYNC_WORKERS; i++) {
+        if (s_workers[i] == current) {
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t portal_async_submit(httpd_req_t *req, portal_async_handler_t handler)
+{
+    if (s_jobs == NULL || xSemaphoreTake(s_idle_workers, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "No worker free for %s", req->uri);
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        httpd_resp_set_hdr(req, "Retry-After", "1");
+        return httpd_resp_sendstr(req, "Server busy");
+    }
+
+    portal_async_job_t job = {.handler = handler};
+    esp_err_t ret = httpd_req_async_handler_begin(req, &job.req);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to detach %s: %s", req->uri, esp_err_to_name(ret));
+        // The worker taken above is still idle
+        xSemaphoreGive(s_idle_workers);
+        return ret;
+    }
+    // Before queueing, the worker may be done before this returns
+    portal_metrics_request_defer(req);
+    // Cannot block: the worker taken above frees a slot in the queue
+    if (xQueueSend(s_jobs, &job, 0) != pdTRUE) {
+        portal_metrics_request_done(job.req, ESP_FAIL);
+        httpd_req_async_handler_complete(job.req);
+        xSemaphoreGive(s_idle_workers);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,41 @@
+//
+// Worker pool the captive portal hands slow requests off to, so its server task keeps serving the others
+//
+
+#ifndef ESP_FOLLOWME2_PORTAL_ASYNC_H
+#define ESP_FOLLOWME2_PORTAL_ASYNC_H
+
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+typedef esp_err_t (*portal_async_handler_t)(httpd_req_t *req);
+
+/**
+ * Starts the workers
+ */
+esp_err_t portal_async_start(void);
+
+/**
+ * Lets the workers finish what they are on and ends them, call before stopping the server
+ */
+void portal_async_stop(void);
+
+/**
+ * Whether the calling task is one of the workers, i.e. a handler runs on behalf of portal_async_submit()
+ */
+bool portal_async_on_worker(void);
+
+/**
+ * Hands the request to a worker running handler on it, to be called from the handler itself:
+ *
+ *     if (!portal_async_on_worker()) {
+ *         return portal_async_submit(req, my_handler);
+ *     }
+ *
+ * If every worker is busy the client gets a 503 right away
+ * @return ESP_OK if the request was handed off or answered, the error otherwise
+ */
+esp_err_t portal_async_submit(httpd_req_t *req, portal_async_handler_t handler);
+
+#endif //ESP_FOLLOWME2_PORTAL_ASYNC_H
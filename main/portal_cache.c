@@ -0,0 +1,234 @@
+//
+// RAM cache of the captive portal asset files read from SPIFFS
+//
+// A handful of files make up the portal, so the cache is a small table searched linearly. Entries are
+// ref-counted: one being sent is never freed under the sender, only marked stale or left out of evictions.
+//
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include "sdkconfig.h"
+#include "portal_cache.h"
+
+static const char *TAG = "PORTAL_CACHE";
+
+#define PORTAL_CACHE_MAX_ENTRIES 8
+
+#if CONFIG_PORTAL_CACHE_PSRAM
+#define PORTAL_CACHE_CAPS (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#else
+#define PORTAL_CACHE_CAPS (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#endif
+
+static portal_cache_entry_t s_entries[PORTAL_CACHE_MAX_ENTRIES];
+static portal_cache_stats_t s_stats;
+static uint32_t s_generation;
+static uint32_t s_clock;
+static SemaphoreHandle_t s_lock;
+
+static void portal_cache_lock(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+}
+
+static void portal_cache_unlock(void)
+{
+    xSemaphoreGive(s_lock);
+}
+
+static void entry_free(portal_cache_entry_t *entry)
+{
+    s_stats.bytes -= entry->len;
+    s_stats.entries--;
+    free((void *)entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static bool entry_stale(const portal_cache_entry_t *entry)
+{
+    return entry->generation != s_generation;
+}
+
+/*
+    Frees least recently used entries until size more bytes fit and a slot is free, unless one was
+    reserved already. Returns the slot to fill, NULL if everything left is being sent right now
+*/
+static portal_cache_entry_t *make_room(portal_cache_entry_t *reserved, size_t size)
+{
+    while (true) {
+        portal_cache_entry_t *free_slot = reserved;
+        portal_cache_entry_t *victim = NULL;
+        for (int i = 0; i < PORTAL_CACHE_MAX_ENTRIES; i++) {
+            portal_cache_entry_t *entry = &s_entries[i];
+            if (entry->data == NULL) {
+                if (!entry->loading) {
+                    free_slot = free_slot ? free_slot : entry;
+                }
+            } else if (entry->refs == 0 && (victim == NULL || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (free_slot && s_stats.bytes + size <= CONFIG_PORTAL_CACHE_SIZE) {
+            return free_slot;
+        }
+        if (victim == NULL) {
+            return NULL;
+        }
+        ESP_LOGD(TAG, "Evicting %s", victim->filename);
+        entry_free(victim);
+        s_stats.evictions++;
+    }
+}
+
+static portal_cache_entry_t *entry_find(const char *filename)
+{
+    for (int i = 0; i < PORTAL_CACHE_MAX_ENTRIES; i++) {
+        portal_cache_entry_t *entry = &s_entries[i];
+        if (entry->data && !entry_stale(entry) && strcmp(entry->filename, filename) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Reads the whole file, called without the lock held. Returns NULL if it cannot be read or is not size bytes long
+static char *file_read(const char *filename, size_t size)
+{
+    char *data = heap_caps_malloc(size, PORTAL_CACHE_CAPS);
+#if CONFIG_PORTAL_CACHE_PSRAM
+    if (data == NULL) {
+        data = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    }
+#endif
+    if (data == NULL) {
+        return NULL;
+    }
+
+    FILE *fp = fopen(filename, "rb");
+    size_t read_len = 0;
+    if (fp) {
+        read_len = fread(data, 1, size, fp);
+        // The manifest's size must be the file's, else the image does not match the firmware
+        if (read_len == size && fgetc(fp) != EOF) {
+            read_len = 0;
+        }
+        fclose(fp);
+    }
+    if (read_len != size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+esp_err_t portal_cache_init(void)
+{
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+    }
+    return s_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+const portal_cache_entry_t *portal_cache_get(const char *filename, size_t size)
+{
+    if (s_lock == NULL || size == 0 || size > CONFIG_PORTAL_CACHE_SIZE || strlen(filename) >= PORTAL_CACHE_NAME_LEN) {
+        return NULL;
+    }
+
+    portal_cache_lock();
+    portal_cache_entry_t *found = entry_find(filename);
+    if (found) {
+        s_stats.hits++;
+        found->refs++;
+        found->last_used = ++s_clock;
+        portal_cache_unlock();
+        return found;
+    }
+    s_stats.misses++;
+    // Reserve a free slot for the file while it is read in, nothing is evicted before its data is in hand
+    portal_cache_entry_t *reserved = NULL;
+    for (int i = 0; i < PORTAL_CACHE_MAX_ENTRIES && reserved == NULL; i++) {
+        if (s_entries[i].data == NULL && !s_entries[i].loading) {
+            reserved = &s_entries[i];
+            reserved->loading = true;
+        }
+    }
+    uint32_t generation = s_generation;
+    portal_cache_unlock();
+
+    // Storage is slow, the other senders keep using the cache meanwhile
+    char *data = file_read(filename, size);
+
+    portal_cache_lock();
+    if (reserved) {
+        reserved->loading = false;
+    }
+    // Another sender may have read the same file meanwhile, an invalidation makes this copy outdated
+    found = entry_find(filename);
+    portal_cache_entry_t *entry = NULL;
+    if (found == NULL && data && generation == s_generation) {
+        entry = make_room(reserved, size);
+    }
+    if (entry) {
+        strcpy(entry->filename, filename);
+        entry->data = data;
+        entry->len = size;
+        entry->generation = generation;
+        s_stats.bytes += size;
+        s_stats.entries++;
+        found = entry;
+    } else {
+        free(data);
+    }
+    if (found) {
+        found->refs++;
+        found->last_used = ++s_clock;
+    }
+    portal_cache_unlock();
+    return found;
+}
+
+void portal_cache_release(const portal_cache_entry_t *entry)
+{
+    if (entry == NULL || s_lock == NULL) {
+        return;
+    }
+    portal_cache_entry_t *e = (portal_cache_entry_t *)entry;
+    portal_cache_lock();
+    if (--e->refs == 0 && entry_stale(e)) {
+        entry_free(e);
+    }
+    portal_cache_unlock();
+}
+
+void portal_cache_invalidate(void)
+{
+    if (s_lock == NULL) {
+        return;
+    }
+    portal_cache_lock();
+    s_generation++;
+    for (int i = 0; i < PORTAL_CACHE_MAX_ENTRIES; i++) {
+        if (s_entries[i].data && s_entries[i].refs == 0) {
+            entry_free(&s_entries[i]);
+        }
+    }
+    portal_cache_unlock();
+    ESP_LOGI(TAG, "Invalidated");
+}
+
+void portal_cache_get_stats(portal_cache_stats_t *stats)
+{
+    if (s_lock == NULL) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    portal_cache_lock();
+    *stats = s_stats;
+    portal_cache_unlock();
+}
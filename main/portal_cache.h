@@ -0,0 +1,64 @@
+//
+// RAM cache of the captive portal asset files read from SPIFFS
+//
+
+#ifndef ESP_FOLLOWME2_PORTAL_CACHE_H
+#define ESP_FOLLOWME2_PORTAL_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define PORTAL_CACHE_NAME_LEN 48
+
+typedef struct {
+    char filename[PORTAL_CACHE_NAME_LEN];
+    const char *data;       // the file's contents, len bytes
+    size_t len;
+    uint32_t generation;    // of the cache when the file was read
+    uint32_t last_used;
+    uint32_t refs;
+    bool loading;           // slot reserved for a file being read in, data is still NULL
+} portal_cache_entry_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t entries;
+    size_t bytes;           // cached file contents, at most CONFIG_PORTAL_CACHE_SIZE
+} portal_cache_stats_t;
+
+/**
+ * Prepares the cache, nothing is cached without it
+ */
+esp_err_t portal_cache_init(void);
+
+/**
+ * Returns the cached contents of a file, reading the whole file in on a miss and evicting the least recently
+ * used files to make room once it has been read. Storage is read without holding up other callers.
+ * Release the entry with portal_cache_release() once sent
+ * @param filename full path of the file
+ * @param size the file's size, as in the asset manifest
+ * @return the entry, NULL if the file cannot be read or does not fit the cache
+ */
+const portal_cache_entry_t *portal_cache_get(const char *filename, size_t size);
+
+/**
+ * Releases an entry returned by portal_cache_get()
+ */
+void portal_cache_release(const portal_cache_entry_t *entry);
+
+/**
+ * Drops every cached file, for anyone updating the files on storage. Entries still in use
+ * are freed when released, they are no longer returned by portal_cache_get()
+ */
+void portal_cache_invalidate(void);
+
+/**
+ * Gets the hit and miss counters and the current fill level
+ */
+void portal_cache_get_stats(portal_cache_stats_t *stats);
+
+#endif //ESP_FOLLOWME2_PORTAL_CACHE_H
@@ -0,0 +1,374 @@
+//
+// Streaming parser for the captive portal's form submissions
+//
+// The body is decoded byte by byte as it comes in, values go straight into their fields:
+// no copy of the body, no intermediate buffers, nothing to log by accident.
+//
+
+#include <string.h>
+#include "portal_form.h"
+
+enum {
+    URL_KEY,
+    URL_VALUE,
+};
+
+enum {
+    JSON_START,
+    JSON_FIRST_MEMBER,      // behind '{', the object may be empty
+    JSON_MEMBER,            // behind ','
+    JSON_KEY,
+    JSON_COLON,
+    JSON_VALUE,
+    JSON_STRING,
+    JSON_LITERAL,           // number, true, false or null of a member that is no field
+    JSON_NEXT,
+    JSON_DONE,
+};
+
+enum {
+    ESC_NONE,
+    ESC_PERCENT,            // %XX
+    ESC_BACKSLASH,          // \X
+    ESC_UNICODE,            // \uXXXX
+};
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool is_json_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static void form_fail(portal_form_parser_t *parser, esp_err_t err)
+{
+    if (parser->err == ESP_OK) {
+        parser->err = err;
+    }
+}
+
+static void form_emit(portal_form_parser_t *parser, uint8_t c)
+{
+    if (parser->in_key) {
+        if (parser->key_len < PORTAL_FORM_KEY_LEN - 1) {
+            parser->key[parser->key_len++] = c;
+        } else {
+            // Longer than any field name, matches none
+            parser->key_len = PORTAL_FORM_KEY_LEN;
+        }
+        return;
+    }
+    portal_form_field_t *field = parser->field;
+    if (field == NULL) {
+        return;
+    }
+    if (c == '\0') {
+        form_fail(parser, ESP_ERR_INVALID_ARG);
+    } else if (field->len >= field->size) {
+        form_fail(parser, ESP_ERR_INVALID_SIZE);
+    } else {
+        field->dst[field->len++] = c;
+    }
+}
+
+static void form_emit_code_point(portal_form_parser_t *parser, uint32_t cp)
+{
+    if (cp < 0x80) {
+        form_emit(parser, cp);
+    } else if (cp < 0x800) {
+        form_emit(parser, 0xc0 | (cp >> 6));
+        form_emit(parser, 0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        form_emit(parser, 0xe0 | (cp >> 12));
+        form_emit(parser, 0x80 | ((cp >> 6) & 0x3f));
+        form_emit(parser, 0x80 | (cp & 0x3f));
+    } else {
+        form_emit(parser, 0xf0 | (cp >> 18));
+        form_emit(parser, 0x80 | ((cp >> 12) & 0x3f));
+        form_emit(parser, 0x80 | ((cp >> 6) & 0x3f));
+        form_emit(parser, 0x80 | (cp & 0x3f));
+    }
+}
+
+static void form_begin_key(portal_form_parser_t *parser)
+{
+    parser->in_key = true;
+    parser->key_len = 0;
+    parser->field = NULL;
+}
+
+// The key is complete, the value that follows goes to the field of that name if there is one
+static void form_begin_value(portal_form_parser_t *parser)
+{
+    parser->in_key = false;
+    parser->field = NULL;
+    if (parser->key_len >= PORTAL_FORM_KEY_LEN) {
+        return;
+    }
+    parser->key[parser->key_len] = '\0';
+    for (int i = 0; i < parser->num_fields; i++) {
+        portal_form_field_t *field = &parser->fields[i];
+        if (strcmp(field->name, parser->key) == 0) {
+            // The last occurrence wins
+            memset(field->dst, 0, field->size);
+            field->len = 0;
+            field->found = true;
+            parser->field = field;
+            return;
+        }
+    }
+}
+
+static void url_feed_char(portal_form_parser_t *parser, char c)
+{
+    if (parser->esc_state == ESC_PERCENT) {
+        int v = hex_value(c);
+        if (v < 0) {
+            form_fail(parser, ESP_ERR_INVALID_ARG);
+            return;
+        }
+        parser->hex = parser->hex << 4 | v;
+        if (++parser->hex_digits == 2) {
+            parser->esc_state = ESC_NONE;
+            form_emit(parser, parser->hex);
+        }
+        return;
+    }
+
+    switch (c) {
+        case '%':
+            parser->esc_state = ESC_PERCENT;
+            parser->hex = 0;
+            parser->hex_digits = 0;
+            break;
+        case '+':
+            form_emit(parser, ' ');
+            break;
+        case '=':
+            if (parser->state == URL_KEY) {
+                form_begin_value(parser);
+                parser->state = URL_VALUE;
+            } else {
+                form_emit(parser, c);
+            }
+            break;
+        case '&':
+            // A key without '=' is a field with an empty value
+            if (parser->state == URL_KEY && parser->key_len > 0) {
+                form_begin_value(parser);
+            }
+            form_begin_key(parser);
+            parser->state = URL_KEY;
+            break;
+        default:
+            form_emit(parser, c);
+            break;
+    }
+}
+
+// A character of a JSON string, the key or a value
+static void json_string_char(portal_form_parser_t *parser, char c)
+{
+    if (parser->esc_state == ESC_BACKSLASH) {
+        parser->esc_state = ESC_NONE;
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                form_emit(parser, c);
+                return;
+            case 'b':
+                form_emit(parser, '\b');
+                return;
+            case 'f':
+                form_emit(parser, '\f');
+                return;
+            case 'n':
+                form_emit(parser, '\n');
+                return;
+            case 'r':
+                form_emit(parser, '\r');
+                return;
+            case 't':
+                form_emit(parser, '\t');
+                return;
+            case 'u':
+                parser->esc_state = ESC_UNICODE;
+                parser->hex = 0;
+                parser->hex_digits = 0;
+                return;
+            default:
+                form_fail(parser, ESP_ERR_INVALID_ARG);
+                return;
+        }
+    }
+
+    if (parser->esc_state == ESC_UNICODE) {
+        int v = hex_value(c);
+        if (v < 0) {
+            form_fail(parser, ESP_ERR_INVALID_ARG);
+            return;
+        }
+        parser->hex = parser->hex << 4 | v;
+        if (++parser->hex_digits < 4) {
+            return;
+        }
+        parser->esc_state = ESC_NONE;
+        uint32_t cp = parser->hex;
+        if (cp >= 0xd800 && cp <= 0xdbff && parser->high_surrogate == 0) {
+            parser->high_surrogate = cp;
+        } else if (cp >= 0xdc00 && cp <= 0xdfff && parser->high_surrogate != 0) {
+            form_emit_code_point(parser, 0x10000 + ((parser->high_surrogate - 0xd800) << 10) + (cp - 0xdc00));
+            parser->high_surrogate = 0;
+        } else if ((cp & 0xf800) == 0xd800 || parser->high_surrogate != 0) {
+            // Lone or misordered surrogate
+            form_fail(parser, ESP_ERR_INVALID_ARG);
+        } else {
+            form_emit_code_point(parser, cp);
+        }
+        return;
+    }
+
+    if (parser->high_surrogate != 0 && c != '\\') {
+        form_fail(parser, ESP_ERR_INVALID_ARG);
+    } else if (c == '\\') {
+        parser->esc_state = ESC_BACKSLASH;
+    } else if (c == '"') {
+        parser->state = parser->state == JSON_KEY ? JSON_COLON : JSON_NEXT;
+    } else if ((uint8_t)c < 0x20) {
+        form_fail(parser, ESP_ERR_INVALID_ARG);
+    } else {
+        form_emit(parser, c);
+    }
+}
+
+static void json_feed_char(portal_form_parser_t *parser, char c)
+{
+    switch (parser->state) {
+        case JSON_KEY:
+        case JSON_STRING:
+            json_string_char(parser, c);
+            return;
+        case JSON_LITERAL:
+            if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'E') {
+                return;
+            }
+            // The literal ended, c belongs to what follows
+            parser->state = JSON_NEXT;
+            break;
+        default:
+            break;
+    }
+
+    if (is_json_space(c)) {
+        return;
+    }
+    switch (parser->state) {
+        case JSON_START:
+            if (c == '{') {
+                parser->state = JSON_FIRST_MEMBER;
+                return;
+            }
+            break;
+        case JSON_FIRST_MEMBER:
+            if (c == '}') {
+                parser->state = JSON_DONE;
+                return;
+            }
+            // fall through
+        case JSON_MEMBER:
+            if (c == '"') {
+                form_begin_key(parser);
+                parser->state = JSON_KEY;
+                return;
+            }
+            break;
+        case JSON_COLON:
+            if (c == ':') {
+                form_begin_value(parser);
+                parser->state = JSON_VALUE;
+                return;
+            }
+            break;
+        case JSON_VALUE:
+            if (c == '"') {
+                parser->state = JSON_STRING;
+                return;
+            }
+            // Fields are strings, other members may be scalars; nested objects and arrays are not supported
+            if (parser->field == NULL && ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-')) {
+                parser->state = JSON_LITERAL;
+                return;
+            }
+            break;
+        case JSON_NEXT:
+            if (c == ',') {
+                parser->state = JSON_MEMBER;
+                return;
+            }
+            if (c == '}') {
+                parser->state = JSON_DONE;
+                return;
+            }
+            break;
+        default:
+            break;
+    }
+    form_fail(parser, ESP_ERR_INVALID_ARG);
+}
+
+void portal_form_init(portal_form_parser_t *parser, portal_form_type_t type, portal_form_field_t *fields, int num_fields)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->type = type;
+    parser->fields = fields;
+    parser->num_fields = num_fields;
+    parser->state = type == PORTAL_FORM_JSON ? JSON_START : URL_KEY;
+    parser->in_key = type == PORTAL_FORM_URLENCODED;
+    for (int i = 0; i < num_fields; i++) {
+        memset(fields[i].dst, 0, fields[i].size);
+        fields[i].len = 0;
+        fields[i].found = false;
+    }
+}
+
+esp_err_t portal_form_feed(portal_form_parser_t *parser, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && parser->err == ESP_OK; i++) {
+        if (parser->type == PORTAL_FORM_JSON) {
+            json_feed_char(parser, data[i]);
+        } else {
+            url_feed_char(parser, data[i]);
+        }
+    }
+    return parser->err;
+}
+
+esp_err_t portal_form_finish(portal_form_parser_t *parser)
+{
+    if (parser->err != ESP_OK) {
+        return parser->err;
+    }
+    if (parser->type == PORTAL_FORM_JSON) {
+        if (parser->state != JSON_DONE) {
+            form_fail(parser, ESP_ERR_INVALID_ARG);
+        }
+    } else if (parser->esc_state != ESC_NONE) {
+        form_fail(parser, ESP_ERR_INVALID_ARG);
+    } else if (parser->state == URL_KEY && parser->key_len > 0) {
+        form_begin_value(parser);
+    }
+    return parser->err;
+}
@@ -0,0 +1,67 @@
+//
+// Streaming parser for the captive portal's form submissions
+//
+
+#ifndef ESP_FOLLOWME2_PORTAL_FORM_H
+#define ESP_FOLLOWME2_PORTAL_FORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+#define PORTAL_FORM_KEY_LEN 16
+
+typedef enum {
+    PORTAL_FORM_URLENCODED,     // application/x-www-form-urlencoded
+    PORTAL_FORM_JSON,           // a flat JSON object, fields are string members
+} portal_form_type_t;
+
+// A field decoded straight into its destination, which is not NUL terminated if the value fills it
+typedef struct {
+    const char *name;
+    uint8_t *dst;
+    size_t size;
+    size_t len;                 // decoded bytes
+    bool found;
+} portal_form_field_t;
+
+// Field decoding into a fixed size array, e.g. PORTAL_FORM_FIELD("ssid", wifi_cfg.sta.ssid)
+#define PORTAL_FORM_FIELD(field_name, array) { .name = (field_name), .dst = (uint8_t *)(array), .size = sizeof(array) }
+
+typedef struct {
+    portal_form_type_t type;
+    portal_form_field_t *fields;
+    int num_fields;
+    esp_err_t err;
+    uint8_t state;
+    bool in_key;                // decoded bytes go to key, not to field
+    char key[PORTAL_FORM_KEY_LEN];
+    uint8_t key_len;            // PORTAL_FORM_KEY_LEN if too long for any field
+    portal_form_field_t *field; // field the current value decodes into, NULL to drop it
+    // Escapes: %XX, or \X and \uXXXX with a possibly pending high surrogate
+    uint8_t esc_state;
+    uint8_t hex_digits;
+    uint32_t hex;
+    uint32_t high_surrogate;
+} portal_form_parser_t;
+
+/**
+ * Prepares a parser filling the given fields, their destinations are zeroed
+ */
+void portal_form_init(portal_form_parser_t *parser, portal_form_type_t type, portal_form_field_t *fields, int num_fields);
+
+/**
+ * Parses the next part of the body, the parts may be split anywhere
+ * @return ESP_OK, ESP_ERR_INVALID_ARG on a malformed body, ESP_ERR_INVALID_SIZE if a value does not fit its field;
+ *         an error sticks, later calls return it again
+ */
+esp_err_t portal_form_feed(portal_form_parser_t *parser, const char *data, size_t len);
+
+/**
+ * Ends the body
+ * @return ESP_OK if the whole body was well-formed, the error of portal_form_feed() otherwise
+ */
+esp_err_t portal_form_finish(portal_form_parser_t *parser);
+
+#endif //ESP_FOLLOWME2_PORTAL_FORM_H
@@ -0,0 +1,380 @@
+//
+// Per-route request counts, bytes sent and service times of the captive portal's HTTP server
+//
+// Handlers are registered through a wrapper that times them with esp_timer_get_time() and points the session's
+// send function at a counting one, so every byte sent on a connection adds to the route it last served.
+// Connections are looked up by socket: a request handed to an async worker keeps its socket until it is done.
+//
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+#include <esp_check.h>
+#include <esp_timer.h>
+#include <lwip/sockets.h>
+#include "sdkconfig.h"
+#include "portal_metrics.h"
+
+static const char *TAG = "PORTAL_METRICS";
+
+#define PORTAL_METRICS_MAX_ROUTES 24
+#define PORTAL_METRICS_ROUTE_LEN 40
+#define PORTAL_METRICS_BUF_SIZE 512
+#define PORTAL_METRICS_MAX_COLLECTORS 4
+
+// Upper bounds of the service time buckets, the last bucket takes everything slower
+static const struct {
+    int64_t us;
+    const char *le;
+} time_buckets[] = {
+        {1000,    "0.001"},
+        {5000,    "0.005"},
+        {10000,   "0.01"},
+        {50000,   "0.05"},
+        {100000,  "0.1"},
+        {500000,  "0.5"},
+        {1000000, "1"},
+        {5000000, "5"},
+};
+
+#define TIME_BUCKETS_COUNT (sizeof(time_buckets) / sizeof(time_buckets[0]))
+
+// Error handlers are recorded under the status they answer
+static const char *const err_statuses[HTTPD_ERR_CODE_MAX] = {
+        [HTTPD_500_INTERNAL_SERVER_ERROR] = "500",
+        [HTTPD_501_METHOD_NOT_IMPLEMENTED] = "501",
+        [HTTPD_505_VERSION_NOT_SUPPORTED] = "505",
+        [HTTPD_400_BAD_REQUEST] = "400",
+        [HTTPD_401_UNAUTHORIZED] = "401",
+        [HTTPD_403_FORBIDDEN] = "403",
+        [HTTPD_404_NOT_FOUND] = "404",
+        [HTTPD_405_METHOD_NOT_ALLOWED] = "405",
+        [HTTPD_408_REQ_TIMEOUT] = "408",
+        [HTTPD_411_LENGTH_REQUIRED] = "411",
+        [HTTPD_414_URI_TOO_LONG] = "414",
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE] = "431",
+};
+
+typedef struct {
+    char uri[PORTAL_METRICS_ROUTE_LEN];     // or the status for error handlers
+    const char *method;
+    esp_err_t (*handler)(httpd_req_t *req);
+    httpd_err_handler_func_t err_handler;
+    void *user_ctx;
+    uint32_t requests;
+    uint32_t errors;                        // handler returned an error, the connection was closed
+    uint64_t bytes;
+    int64_t time_sum_us;
+    int64_t time_max_us;
+    uint32_t time_buckets[TIME_BUCKETS_COUNT + 1];
+} metrics_route_t;
+
+typedef struct {
+    metrics_route_t *route;                 // last served, gets the bytes sent
+    int64_t start_us;
+    bool in_flight;
+    bool deferred;
+} metrics_conn_t;
+
+static metrics_route_t s_routes[PORTAL_METRICS_MAX_ROUTES];
+static int s_route_count;
+static metrics_route_t *s_err_routes[HTTPD_ERR_CODE_MAX];
+static metrics_conn_t s_conns[CONFIG_LWIP_MAX_SOCKETS];
+static SemaphoreHandle_t s_lock;
+typedef struct {
+    portal_metrics_collector_t collector;
+    void *arg;
+} metrics_collector_t;
+
+static metrics_collector_t s_collectors[PORTAL_METRICS_MAX_COLLECTORS];
+
+static void portal_metrics_lock(void)
+{
+    xSemaphoreTake(s_lock, portMAX_DELAY);
+}
+
+static void portal_metrics_unlock(void)
+{
+    xSemaphoreGive(s_lock);
+}
+
+// lwip numbers its sockets from LWIP_SOCKET_OFFSET on
+static metrics_conn_t *conn_of(int sockfd)
+{
+    int index = sockfd - LWIP_SOCKET_OFFSET;
+    return index >= 0 && index < CONFIG_LWIP_MAX_SOCKETS ? &s_conns[index] : NULL;
+}
+
+static metrics_route_t *route_get(const char *uri, const char *method)
+{
+    for (int i = 0; i < s_route_count; i++) {
+        if (strcmp(s_routes[i].uri, uri) == 0 && strcmp(s_routes[i].method, method) == 0) {
+            return &s_routes[i];
+        }
+    }
+    ESP_RETURN_ON_FALSE(s_route_count < PORTAL_METRICS_MAX_ROUTES && strlen(uri) < PORTAL_METRICS_ROUTE_LEN,
+                        NULL, TAG, "No room to record %s", uri);
+    metrics_route_t *route = &s_routes[s_route_count++];
+    strcpy(route->uri, uri);
+    route->method = method;
+    return route;
+}
+
+static int metrics_send(httpd_handle_t hd, int sockfd, const char *buf, size_t buf_len, int flags)
+{
+    int ret = httpd_default_send(hd, sockfd, buf, buf_len, flags);
+    if (ret > 0) {
+        portal_metrics_lock();
+        metrics_conn_t *conn = conn_of(sockfd);
+        if (conn && conn->route) {
+            conn->route->bytes += ret;
+        }
+        portal_metrics_unlock();
+    }
+    return ret;
+}
+
+static void request_begin(httpd_req_t *req, metrics_route_t *route)
+{
+    int sockfd = httpd_req_to_sockfd(req);
+    portal_metrics_lock();
+    metrics_conn_t *conn = conn_of(sockfd);
+    if (conn) {
+        conn->route = route;
+        conn->start_us = esp_timer_get_time();
+        conn->in_flight = true;
+        conn->deferred = false;
+    }
+    portal_metrics_unlock();
+    httpd_sess_set_send_override(req->handle, sockfd, metrics_send);
+}
+
+// A deferred request is only recorded by whoever finishes it
+static void request_end(httpd_req_t *req, esp_err_t result, bool finishing_deferred)
+{
+    int64_t now = esp_timer_get_time();
+    portal_metrics_lock();
+    metrics_conn_t *conn = conn_of(httpd_req_to_sockfd(req));
+    if (conn && conn->route && conn->in_flight && conn->deferred == finishing_deferred) {
+        metrics_route_t *route = conn->route;
+        int64_t time_us = now - conn->start_us;
+        int bucket = 0;
+        while (bucket < TIME_BUCKETS_COUNT && time_us > time_buckets[bucket].us) {
+            bucket++;
+        }
+        route->requests++;
+        route->errors += result != ESP_OK;
+        route->time_sum_us += time_us;
+        route->time_max_us = MAX(route->time_max_us, time_us);
+        route->time_buckets[bucket]++;
+        conn->in_flight = false;
+    }
+    portal_metrics_unlock();
+}
+
+static esp_err_t metrics_uri_handler(httpd_req_t *req)
+{
+    metrics_route_t *route = req->user_ctx;
+    // The handler sees what it was registered with
+    req->user_ctx = route->user_ctx;
+    request_begin(req, route);
+    esp_err_t ret = route->handler(req);
+    request_end(req, ret, false);
+    return ret;
+}
+
+static esp_err_t metrics_err_handler(httpd_req_t *req, httpd_err_code_t error)
+{
+    metrics_route_t *route = s_err_routes[error];
+    request_begin(req, route);
+    esp_err_t ret = route->err_handler(req, error);
+    request_end(req, ret, false);
+    return ret;
+}
+
+esp_err_t portal_metrics_init(void)
+{
+    if (s_lock == NULL) {
+        s_lock = xSemaphoreCreateMutex();
+    }
+    return s_lock ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t portal_metrics_register_uri_handler(httpd_handle_t server, const httpd_uri_t *uri)
+{
+    metrics_route_t *route = s_lock ? route_get(uri->uri, http_method_str(uri->method)) : NULL;
+    if (route == NULL) {
+        return httpd_register_uri_handler(server, uri);
+    }
+    route->handler = uri->handler;
+    route->user_ctx = uri->user_ctx;
+    httpd_uri_t wrapped = *uri;
+    wrapped.handler = metrics_uri_handler;
+    wrapped.user_ctx = route;
+    return httpd_register_uri_handler(server, &wrapped);
+}
+
+esp_err_t portal_metrics_register_err_handler(httpd_handle_t server, httpd_err_code_t error,
+                                              httpd_err_handler_func_t handler)
+{
+    metrics_route_t *route = s_lock && error < HTTPD_ERR_CODE_MAX && err_statuses[error] ?
+                             route_get(err_statuses[error], "*") : NULL;
+    if (route == NULL) {
+        return httpd_register_err_handler(server, error, handler);
+    }
+    route->err_handler = handler;
+    s_err_routes[error] = route;
+    return httpd_register_err_handler(server, error, metrics_err_handler);
+}
+
+esp_err_t portal_metrics_add_collector(portal_metrics_collector_t collector, void *arg)
+{
+    ESP_RETURN_ON_FALSE(s_lock, ESP_ERR_INVALID_STATE, TAG, "Metrics not initialized");
+    esp_err_t ret = ESP_ERR_NO_MEM;
+    portal_metrics_lock();
+    for (int i = 0; i < PORTAL_METRICS_MAX_COLLECTORS; i++) {
+        // Added again after a restart, it only gets a new argument
+        if (s_collectors[i].collector == collector || s_collectors[i].collector == NULL) {
+            s_collectors[i].collector = collector;
+            s_collectors[i].arg = arg;
+            ret = ESP_OK;
+            break;
+        }
+    }
+    portal_metrics_unlock();
+    return ret;
+}
+
+void portal_metrics_request_defer(httpd_req_t *req)
+{
+    if (s_lock == NULL) {
+        return;
+    }
+    portal_metrics_lock();
+    metrics_conn_t *conn = conn_of(httpd_req_to_sockfd(req));
+    if (conn && conn->in_flight) {
+        conn->deferred = true;
+    }
+    portal_metrics_unlock();
+}
+
+void portal_metrics_request_done(httpd_req_t *req, esp_err_t result)
+{
+    if (s_lock) {
+        request_end(req, result, true);
+    }
+}
+
+struct portal_metrics_stream {
+    httpd_req_t *req;
+    esp_err_t err;
+    char buf[PORTAL_METRICS_BUF_SIZE];
+    size_t len;
+};
+
+static void metrics_flush(portal_metrics_stream_t *stream)
+{
+    if (stream->err == ESP_OK && stream->len > 0) {
+        stream->err = httpd_resp_send_chunk(stream->req, stream->buf, stream->len);
+    }
+    stream->len = 0;
+}
+
+// Appends a line, sending what is buffered first if it does not fit
+void portal_metrics_printf(portal_metrics_stream_t *stream, const char *fmt, ...)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(stream->buf + stream->len, sizeof(stream->buf) - stream->len, fmt, args);
+        va_end(args);
+        if (len >= 0 && stream->len + len < sizeof(stream->buf)) {
+            stream->len += len;
+            return;
+        }
+        metrics_flush(stream);
+    }
+    ESP_LOGW(TAG, "Metrics line too long, dropped");
+}
+
+#define ROUTE_LABELS "{route=\"%s\",method=\"%s\""
+
+esp_err_t portal_metrics_get_handler(httpd_req_t *req)
+{
+    ESP_RETURN_ON_FALSE(s_lock, httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No metrics"), TAG,
+                        "Metrics not initialized");
+
+    // A consistent copy, formatted without holding up the handlers
+    portal_metrics_stream_t *stream = malloc(sizeof(portal_metrics_stream_t));
+    metrics_route_t *routes = malloc(sizeof(s_routes));
+    esp_err_t ret = ESP_OK;
+    ESP_GOTO_ON_FALSE(stream && routes, ESP_ERR_NO_MEM, end, TAG, "Failed to allocate memory for the metrics");
+    portal_metrics_lock();
+    int count = s_route_count;
+    memcpy(routes, s_routes, sizeof(s_routes));
+    metrics_collector_t collectors[PORTAL_METRICS_MAX_COLLECTORS];
+    memcpy(collectors, s_collectors, sizeof(s_collectors));
+    portal_metrics_unlock();
+    stream->req = req;
+    stream->err = ESP_OK;
+    stream->len = 0;
+
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+    portal_metrics_printf(stream, "# TYPE portal_http_requests_total counter\n");
+    for (int i = 0; i < count; i++) {
+        portal_metrics_printf(stream, "portal_http_requests_total" ROUTE_LABELS "} %" PRIu32 "\n",
+                       routes[i].uri, routes[i].method, routes[i].requests);
+    }
+    portal_metrics_printf(stream, "# TYPE portal_http_handler_errors_total counter\n");
+    for (int i = 0; i < count; i++) {
+        portal_metrics_printf(stream, "portal_http_handler_errors_total" ROUTE_LABELS "} %" PRIu32 "\n",
+                       routes[i].uri, routes[i].method, routes[i].errors);
+    }
+    portal_metrics_printf(stream, "# TYPE portal_http_sent_bytes_total counter\n");
+    for (int i = 0; i < count; i++) {
+        portal_metrics_printf(stream, "portal_http_sent_bytes_total" ROUTE_LABELS "} %" PRIu64 "\n",
+                       routes[i].uri, routes[i].method, routes[i].bytes);
+    }
+    portal_metrics_printf(stream, "# TYPE portal_http_service_seconds histogram\n");
+    for (int i = 0; i < count; i++) {
+        const metrics_route_t *route = &routes[i];
+        uint32_t cumulative = 0;
+        for (int b = 0; b < TIME_BUCKETS_COUNT; b++) {
+            cumulative += route->time_buckets[b];
+            portal_metrics_printf(stream, "portal_http_service_seconds_bucket" ROUTE_LABELS ",le=\"%s\"} %" PRIu32 "\n",
+                           route->uri, route->method, time_buckets[b].le, cumulative);
+        }
+        portal_metrics_printf(stream, "portal_http_service_seconds_bucket" ROUTE_LABELS ",le=\"+Inf\"} %" PRIu32 "\n",
+                       route->uri, route->method, route->requests);
+        portal_metrics_printf(stream, "portal_http_service_seconds_sum" ROUTE_LABELS "} %" PRId64 ".%06" PRId64 "\n",
+                       route->uri, route->method, route->time_sum_us / 1000000, route->time_sum_us % 1000000);
+        portal_metrics_printf(stream, "portal_http_service_seconds_count" ROUTE_LABELS "} %" PRIu32 "\n",
+                       route->uri, route->method, route->requests);
+    }
+    portal_metrics_printf(stream, "# TYPE portal_http_service_max_seconds gauge\n");
+    for (int i = 0; i < count; i++) {
+        portal_metrics_printf(stream, "portal_http_service_max_seconds" ROUTE_LABELS "} %" PRId64 ".%06" PRId64 "\n",
+                       routes[i].uri, routes[i].method, routes[i].time_max_us / 1000000,
+                       routes[i].time_max_us % 1000000);
+    }
+    for (int i = 0; i < PORTAL_METRICS_MAX_COLLECTORS && collectors[i].collector; i++) {
+        collectors[i].collector(stream, collectors[i].arg);
+    }
+    metrics_flush(stream);
+    ESP_GOTO_ON_ERROR(stream->err, end, TAG, "send response failed");
+    ret = httpd_resp_send_chunk(req, NULL, 0);
+
+    end:
+    free(routes);
+    free(stream);
+    return ret;
+}
@@ -0,0 +1,65 @@
+//
+// Per-route request counts, bytes sent and service times of the captive portal's HTTP server
+//
+
+#ifndef ESP_FOLLOWME2_PORTAL_METRICS_H
+#define ESP_FOLLOWME2_PORTAL_METRICS_H
+
+#include "esp_err.h"
+#include "esp_http_server.h"
+
+#define PORTAL_METRICS_URI "/metrics"
+
+/**
+ * Prepares the route table, nothing is recorded without it
+ */
+esp_err_t portal_metrics_init(void);
+
+/**
+ * Registers a URI handler like httpd_register_uri_handler(), wrapped to record its requests.
+ * The handler still gets its own user_ctx. Routes keep their numbers when registered again after a restart
+ */
+esp_err_t portal_metrics_register_uri_handler(httpd_handle_t server, const httpd_uri_t *uri);
+
+/**
+ * Registers an error handler like httpd_register_err_handler(), wrapped to record its requests
+ */
+esp_err_t portal_metrics_register_err_handler(httpd_handle_t server, httpd_err_code_t error,
+                                              httpd_err_handler_func_t handler);
+
+// Output of the metrics handler, see portal_metrics_printf()
+typedef struct portal_metrics_stream portal_metrics_stream_t;
+
+// Adds metrics of its own to every PORTAL_METRICS_URI answer, after the routes'
+typedef void (*portal_metrics_collector_t)(portal_metrics_stream_t *stream, void *arg);
+
+/**
+ * Adds a collector, run by the metrics handler in the server task with arg
+ * @return ESP_OK, ESP_ERR_NO_MEM if there are too many
+ */
+esp_err_t portal_metrics_add_collector(portal_metrics_collector_t collector, void *arg);
+
+/**
+ * Appends to the answer, for collectors: whole lines in the Prometheus text format
+ */
+void portal_metrics_printf(portal_metrics_stream_t *stream, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Marks the request of a handler as finished elsewhere, e.g. by an async worker, which then calls
+ * portal_metrics_request_done(). Call before handing the request off
+ */
+void portal_metrics_request_defer(httpd_req_t *req);
+
+/**
+ * Records the end of a request deferred with portal_metrics_request_defer()
+ * @param req the request or its async copy
+ * @param result what its handler returned
+ */
+void portal_metrics_request_done(httpd_req_t *req, esp_err_t result);
+
+/**
+ * Handler of PORTAL_METRICS_URI, answers with every route's numbers in the Prometheus text format
+ */
+esp_err_t portal_metrics_get_handler(httpd_req_t *req);
+
+#endif //ESP_FOLLOWME2_PORTAL_METRICS_H
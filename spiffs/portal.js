@@ -0,0 +1,98 @@
+const form = document.querySelector('form')
+const select = document.getElementById('select-ssids')
+const firstOption = select.options[0]
+const ssidInput = document.getElementById('input-ssid')
+const submitButton = document.getElementById('btn_submit')
+const wifiStatus = document.getElementById('wifi-status')
+
+function request(method, url, body, done) {
+  const xhr = new XMLHttpRequest()
+  xhr.open(method, url)
+  xhr.timeout = 15*1000
+  xhr.onload = () => done(xhr.status === 200 ? null : xhr.status + ' ' + xhr.statusText, xhr.responseText)
+  xhr.onerror = () => done('error')
+  xhr.ontimeout = () => done('timeout')
+  xhr.send(body)
+}
+
+select.onchange = () => {
+  if (select.value) {
+    ssidInput.value = select.value
+  }
+}
+
+function showAps(aps) {
+  firstOption.textContent = '扫描到' + aps.length + '个接入点'
+  // Already one entry per SSID, strongest first
+  aps.forEach(ap => select.add(new Option(ap.ssid + ' (' + ap.rssi + ')', ap.ssid)))
+}
+
+function scanFailed(error) {
+  firstOption.textContent = '获取WiFi列表失败'
+  console.error('获取WiFi列表失败: ' + error)
+}
+
+// The device renders its latest scan results into the page, if it had none yet they are fetched
+function showScanResults(aps) {
+  if (aps.length > 0) {
+    showAps(aps)
+    return
+  }
+  request('GET', '/scan', null, (error, text) => {
+    try {
+      error ? scanFailed(error) : showAps(JSON.parse(text))
+    } catch (e) {
+      scanFailed(e)
+    }
+  })
+}
+
+// Progress of the connection attempt, pushed by the device
+const states = {
+  'connecting': '正在连接...',
+  'got-ip': '连接成功，IP: ',
+  'auth-fail': '连接失败：密码错误',
+  'not-found': '连接失败：找不到接入点',
+  'disconnected': '连接已断开'
+}
+let connected = false
+function watchWifiState() {
+  const ws = new WebSocket('ws://' + location.host + '/ws')
+  ws.onmessage = e => {
+    const msg = JSON.parse(e.data)
+    wifiStatus.textContent = (states[msg.state] || msg.state) + (msg.ip || '')
+    connected = msg.state === 'got-ip'
+    if (msg.state === 'auth-fail' || msg.state === 'not-found') {
+      submitButton.disabled = false
+    }
+  }
+  // The softAP goes away once the device is online, until then keep listening
+  ws.onclose = () => connected || setTimeout(watchWifiState, 2000)
+}
+watchWifiState()
+
+form.onsubmit = e => {
+  e.preventDefault()
+  const ssid = ssidInput.value.trim()
+
+  if (!ssid) {
+    alert('请填写SSID')
+    return
+  }
+
+  submitButton.disabled = true
+
+  request('POST', form.action, new URLSearchParams(new FormData(form)), (error, data) => {
+    if (error) {
+      submitButton.disabled = false
+      console.error('保存失败: ' + error)
+      alert('保存失败: ' + error)
+    } else if (data === 'ok') {
+      // The outcome arrives over the WebSocket
+      wifiStatus.textContent = states['connecting']
+    } else {
+      submitButton.disabled = false
+      alert('保存失败：' + data)
+    }
+  })
+}
@@ -0,0 +1,370 @@
+#!/usr/bin/env python
+#
+# Prepares the captive portal assets for the SPIFFS image: every file of the source directory is copied,
+# and text assets get a pre-compressed .gz variant next to them, served to clients accepting gzip.
+#
+# Pages refer to the other assets by versioned URLs (name?v=<content hash>), so those can be cached forever,
+# and a C header listing every asset with its hash is generated for the HTTP server's ETags. The header is also
+# the server's index of what it can serve at all, everything else is answered without a filesystem lookup.
+#
+# index.html is the template of the portal page, built so first paint needs this one response:
+#   <script src="x.js" data-inline></script>
+#       the script is inlined, x.js is not shipped on its own
+#   <link rel="stylesheet" href="x.css" data-inline="critical">
+#       the rules that can match the page's markup (tags, classes and ids of the template and the inlined scripts)
+#       are inlined; the rest of x.css is shipped as x.css, a versioned asset loaded without blocking rendering
+# The result is minified and split at the /*SCAN_RESULTS*/ marker. The device serves the part in front of the marker
+# from portal.html, renders its latest scan results as JSON in place of the marker and ends with the short rest,
+# taken from the header. portal.html.gz holds the first part as a gzip stream left open for the device to continue.
+#
+# The same assets can also be packed into a single bundle for the "assets" partition, served straight from
+# memory-mapped flash (CONFIG_PORTAL_ASSETS_BUNDLE). Little endian layout, see main/portal_assets.c:
+#   header:  magic "PAB2", u16 entry count, u16 reserved, u32 version (PORTAL_ASSETS_BUNDLE_VERSION of the manifest)
+#   index:   per asset char path[32] (NUL padded), u32 offset, u32 size, u32 gz offset, u32 gz size
+#   blobs:   4-byte aligned, offsets count from the start of the bundle
+#
+# The version is the CRC-32 of the manifest, so the firmware only maps a bundle flashed from the same build. The
+# partition is only written by a full flash, after an app-only update the old bundle must not be served.
+#
+# Usage: portal_assets.py <source dir> <output dir> --manifest <header> --bundle <image>
+
+import argparse
+import gzip
+import hashlib
+import os
+import re
+import shutil
+import struct
+import zlib
+
+COMPRESSIBLE = ('.html', '.css', '.js', '.json', '.svg', '.txt')
+PAGES = ('.html',)
+# Relative references to other assets in pages, e.g. src="app.js"
+REFERENCE = re.compile(r'\b(src|href)="([^"/?#:]+)"')
+
+PAGE_TEMPLATE = 'index.html'
+PAGE_NAME = 'portal.html'
+SCAN_MARKER = '/*SCAN_RESULTS*/'
+# The rest of the page behind the marker lives in the header, it has to stay short
+PAGE_SUFFIX_MAX_LEN = 64
+SCRIPT = re.compile(r'(<script[^>]*>)(.*?)(</script>)', re.DOTALL)
+INLINE_SCRIPT = re.compile(r'<script src="([^"/?#:]+)" data-inline></script>')
+INLINE_STYLESHEET = re.compile(r'<link rel="stylesheet" href="([^"/?#:]+)" data-inline="critical">')
+# Deferred stylesheet: applied once loaded, without holding up the first paint
+DEFERRED_STYLESHEET = '<link rel="stylesheet" href="{}" media="print" onload="this.media=\'all\'">'
+
+MANIFEST_HEADER = '''\
+/*
+ * Generated by tools/portal_assets.py from the portal assets, do not edit
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {{
+    const char *path;       // URI path of the asset, also its path below the SPIFFS mount point
+    const char *version;    // content hash, the ETag and the ?v= query of versioned references
+    size_t size;
+    size_t gz_size;         // 0 if there is no .gz variant
+    bool versioned;         // referenced by versioned URLs only, may be cached forever
+}} portal_asset_t;
+
+// Sorted by path in strcmp() order, for a binary search
+static const portal_asset_t portal_assets[] = {{
+{entries}
+}};
+
+#define PORTAL_ASSETS_COUNT (sizeof(portal_assets) / sizeof(portal_assets[0]))
+
+// Bounds of the path lengths, anything outside is no asset
+#define PORTAL_ASSET_PATH_MIN_LEN {min_len}
+#define PORTAL_ASSET_PATH_MAX_LEN {max_len}
+
+// The portal page: PORTAL_PAGE_PATH holds the part in front of the scan results, PORTAL_PAGE_SUFFIX follows them.
+// Its .gz variant is a gzip stream of the first part left open, PORTAL_PAGE_CRC is the CRC-32 of that part
+#define PORTAL_PAGE_PATH "/{page}"
+#define PORTAL_PAGE_CRC 0x{page_crc:08x}u
+#define PORTAL_PAGE_SUFFIX "{page_suffix}"
+'''
+
+MANIFEST_VERSION = '''
+// Identifies the asset bundle built along with this manifest, see tools/portal_assets.py
+#define PORTAL_ASSETS_BUNDLE_VERSION 0x{version:08x}u
+'''
+
+BUNDLE_MAGIC = 0x32424150   # "PAB2"
+BUNDLE_HEADER = struct.Struct('<IHHI')
+BUNDLE_PATH_LEN = 32
+
+
+def compress(data):
+    # mtime=0 keeps the image reproducible, the same input always gives the same bytes
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def content_hash(data):
+    return hashlib.sha256(data).hexdigest()[:16]
+
+
+def version_references(page, versions):
+    def replace(match):
+        name = match.group(2)
+        if name not in versions:
+            return match.group(0)
+        return '{}="{}?v={}"'.format(match.group(1), name, versions[name])
+    return REFERENCE.sub(replace, page.decode('utf-8')).encode('utf-8')
+
+
+def minify_html(html):
+    html = re.sub(r'<!--.*?-->', '', html, flags=re.DOTALL)
+    html = re.sub(r'>\s+<', '><', html)
+    return re.sub(r'\s*\n\s*', ' ', html).strip()
+
+
+def minify_js(js):
+    # Indentation, blank lines and comments on lines of their own, nothing that needs a parser
+    lines = (line.strip() for line in js.splitlines())
+    return '\n'.join(line for line in lines if line and not line.startswith('//'))
+
+
+# Tags, classes and ids a selector may match in the page, everything else is taken as present
+def page_vocabulary(html, scripts):
+    tags = set(re.findall(r'<([a-z][a-z0-9]*)', html)) | {'html', 'body'}
+    tags |= set(re.findall(r'createElement\([\'"]([a-z0-9]+)', scripts))
+    if 'new Option(' in scripts:
+        tags.add('option')
+    classes = set()
+    for value in re.findall(r'class="([^"]*)"', html):
+        classes.update(value.split())
+    classes |= set(re.findall(r'classList\.(?:add|toggle)\([\'"]([\w-]+)', scripts))
+    ids = set(re.findall(r'id="([^"]+)"', html))
+    return tags, classes, ids
+
+
+def selector_may_match(selector, vocabulary):
+    tags, classes, ids = vocabulary
+    # Pseudo classes and elements and attribute conditions never rule a compound out
+    selector = re.sub(r'\[[^\]]*\]|::?[\w-]+(\([^)]*\))?', '', selector)
+    for compound in re.split(r'[\s>+~]+', selector.strip()):
+        tag = re.match(r'[a-z][a-z0-9]*', compound)
+        if tag and tag.group(0) not in tags:
+            return False
+        if any(c not in classes for c in re.findall(r'\.([\w-]+)', compound)):
+            return False
+        if any(i not in ids for i in re.findall(r'#([\w-]+)', compound)):
+            return False
+    return True
+
+
+# Splits minified CSS into the rules that may match the page and the rest, both minified CSS again
+def split_critical(css, vocabulary):
+    critical = ''
+    rest = ''
+    pos = 0
+    while pos < len(css):
+        if css.startswith('/*', pos):
+            end = css.index('*/', pos) + 2
+            # License comments stay with whatever is shipped as the file
+            rest += css[pos:end]
+            pos = end
+            continue
+        brace = css.find('{', pos)
+        if brace < 0:
+            rest += css[pos:]
+            break
+        prelude = css[pos:brace].strip()
+        depth, end = 0, brace
+        while True:
+            depth += {'{': 1, '}': -1}.get(css[end], 0)
+            end += 1
+            if depth == 0:
+                break
+        body = css[brace + 1:end - 1]
+        if prelude.startswith('@media') or prelude.startswith('@supports'):
+            inner_critical, inner_rest = split_critical(body, vocabulary)
+            critical += '{}{{{}}}'.format(prelude, inner_critical) if inner_critical else ''
+            rest += '{}{{{}}}'.format(prelude, inner_rest) if inner_rest.strip() else ''
+        elif prelude.startswith('@'):
+            rest += css[pos:end]
+        else:
+            selectors = [sel.strip() for sel in prelude.split(',')]
+            matching = [sel for sel in selectors if selector_may_match(sel, vocabulary)]
+            others = [sel for sel in selectors if sel not in matching]
+            critical += '{}{{{}}}'.format(','.join(matching), body) if matching else ''
+            rest += '{}{{{}}}'.format(','.join(others), body) if others else ''
+        pos = end
+    return critical, rest
+
+
+# Inlines the template's data-inline scripts and critical styles. Returns the page and the new contents of
+# the assets involved, None for those no longer shipped
+def inline_assets(template, assets):
+    html = template.decode('utf-8')
+    changed = {}
+    scripts = ''
+    for match in INLINE_SCRIPT.finditer(html):
+        scripts += assets[match.group(1)].decode('utf-8')
+    vocabulary = page_vocabulary(html, scripts)
+
+    def script(match):
+        js = assets[match.group(1)].decode('utf-8').strip()
+        if '</script' in js.lower():
+            raise ValueError('{}: cannot be inlined'.format(match.group(1)))
+        changed[match.group(1)] = None
+        return '<script>{}</script>'.format(js)
+
+    def stylesheet(match):
+        name = match.group(1)
+        critical, rest = split_critical(assets[name].decode('utf-8').strip(), vocabulary)
+        if '</style' in critical.lower():
+            raise ValueError('{}: cannot be inlined'.format(name))
+        has_rules = '{' in rest
+        changed[name] = rest.encode('utf-8') if has_rules else None
+        return '<style>{}</style>{}'.format(critical, DEFERRED_STYLESHEET.format(name) if has_rules else '')
+
+    html = INLINE_SCRIPT.sub(script, html)
+    html = INLINE_STYLESHEET.sub(stylesheet, html)
+    return html.encode('utf-8'), changed
+
+
+def build_page(template, versions):
+    page = version_references(template, versions).decode('utf-8')
+
+    # Scripts keep their line breaks, everything around them is collapsed
+    parts = []
+    pos = 0
+    for match in SCRIPT.finditer(page):
+        parts.append(minify_html(page[pos:match.start()]))
+        parts.append(match.group(1) + minify_js(match.group(2)) + match.group(3))
+        pos = match.end()
+    parts.append(minify_html(page[pos:]))
+    page = ''.join(parts)
+
+    if page.count(SCAN_MARKER) != 1:
+        raise ValueError('{}: needs exactly one {} marker'.format(PAGE_TEMPLATE, SCAN_MARKER))
+    prefix, suffix = page.encode('utf-8').split(SCAN_MARKER.encode())
+    if len(suffix) > PAGE_SUFFIX_MAX_LEN or re.search(rb'["\\\x00-\x1f\x80-\xff]', suffix):
+        raise ValueError('{}: too much or odd text behind the {} marker'.format(PAGE_TEMPLATE, SCAN_MARKER))
+    return prefix, suffix.decode()
+
+
+def compress_open(data):
+    # A gzip header and the deflated data synced to a byte boundary, without the last block and the trailer;
+    # the device appends stored blocks and the trailer itself, see send_portal_page()
+    header = b'\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\xff'
+    deflate = zlib.compressobj(9, zlib.DEFLATED, -15)
+    return header + deflate.compress(data) + deflate.flush(zlib.Z_SYNC_FLUSH)
+
+
+# files: list of (URI path, data, gzipped data or None)
+def pack_bundle(files, version):
+    entry = struct.Struct('<{}sIIII'.format(BUNDLE_PATH_LEN))
+    offset = BUNDLE_HEADER.size + entry.size * len(files)
+    index = b''
+    blobs = b''
+    for path, data, packed in files:
+        if len(path.encode()) >= BUNDLE_PATH_LEN:
+            raise ValueError('{}: path too long for the bundle'.format(path))
+        fields = []
+        for blob in (data, packed or b''):
+            pad = -(offset + len(blobs)) % 4
+            blobs += b'\0' * pad
+            fields += [offset + len(blobs) if blob else 0, len(blob)]
+            blobs += blob
+        index += entry.pack(path.encode(), *fields)
+    return BUNDLE_HEADER.pack(BUNDLE_MAGIC, len(files), 0, version) + index + blobs
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Prepare the captive portal assets for the SPIFFS image')
+    parser.add_argument('src', help='directory holding the portal assets')
+    parser.add_argument('dst', help='directory the SPIFFS image is built from')
+    parser.add_argument('--manifest', help='C header listing the assets, written if given')
+    parser.add_argument('--bundle', help='asset bundle image for the assets partition, written if given')
+    args = parser.parse_args()
+
+    assets = {}
+    # Byte order is strcmp() order, the manifest is searched by it
+    for name in sorted(os.listdir(args.src), key=lambda n: n.encode()):
+        src = os.path.join(args.src, name)
+        if os.path.isfile(src):
+            with open(src, 'rb') as f:
+                assets[name] = f.read()
+
+    if PAGE_TEMPLATE not in assets:
+        raise ValueError('{}: no {}'.format(args.src, PAGE_TEMPLATE))
+    template, inlined = inline_assets(assets.pop(PAGE_TEMPLATE), assets)
+    for name, data in inlined.items():
+        if data is None:
+            del assets[name]
+        else:
+            assets[name] = data
+
+    # Pages are never cached for long, everything they reference gets versioned
+    versions = {name: content_hash(data) for name, data in assets.items() if not name.endswith(PAGES)}
+    for name in assets:
+        if name.endswith(PAGES):
+            assets[name] = version_references(assets[name], versions)
+    page, page_suffix = build_page(template, versions)
+
+    # Start over, files removed from the source must not linger in the image
+    if os.path.isdir(args.dst):
+        shutil.rmtree(args.dst)
+    os.makedirs(args.dst)
+
+    entries = []
+    bundle = []
+
+    page_gz = compress_open(page)
+    for name, data in ((PAGE_NAME, page), (PAGE_NAME + '.gz', page_gz)):
+        with open(os.path.join(args.dst, name), 'wb') as f:
+            f.write(data)
+    print('{}: {} -> {} bytes gzipped'.format(PAGE_NAME, len(page), len(page_gz)))
+    entries.append('    {{ "/{}", "{}", {}, {}, false }},'.format(PAGE_NAME, content_hash(page), len(page), len(page_gz)))
+    bundle.append(('/' + PAGE_NAME, page, page_gz))
+
+    for name, data in assets.items():
+        with open(os.path.join(args.dst, name), 'wb') as f:
+            f.write(data)
+
+        packed = None
+        if name.endswith(COMPRESSIBLE):
+            packed = compress(data)
+            # Not worth a second file if gzip hardly helps
+            if len(packed) < len(data) * 9 // 10:
+                with open(os.path.join(args.dst, name + '.gz'), 'wb') as f:
+                    f.write(packed)
+                print('{}: {} -> {} bytes gzipped'.format(name, len(data), len(packed)))
+            else:
+                packed = None
+
+        entries.append('    {{ "/{}", "{}", {}, {}, {} }},'.format(
+            name, content_hash(data), len(data), len(packed) if packed else 0, 'true' if name in versions else 'false'))
+        bundle.append(('/' + name, data, packed))
+
+    # The page's entry has to take its place in strcmp() order too
+    order = sorted(range(len(bundle)), key=lambda i: bundle[i][0].encode())
+    paths = [path for path, _, _ in bundle]
+    manifest = MANIFEST_HEADER.format(entries='\n'.join(entries[i] for i in order),
+                                      page=PAGE_NAME, page_crc=zlib.crc32(page), page_suffix=page_suffix,
+                                      min_len=min(len(p.encode()) for p in paths),
+                                      max_len=max(len(p.encode()) for p in paths))
+    # Covers every asset's hash and sizes and the page's CRC
+    version = zlib.crc32(manifest.encode())
+
+    if args.manifest:
+        os.makedirs(os.path.dirname(os.path.abspath(args.manifest)), exist_ok=True)
+        with open(args.manifest, 'w') as f:
+            f.write(manifest + MANIFEST_VERSION.format(version=version))
+
+    if args.bundle:
+        image = pack_bundle(bundle, version)
+        with open(args.bundle, 'wb') as f:
+            f.write(image)
+        print('Asset bundle: {} bytes'.format(len(image)))
+
+
+if __name__ == '__main__':
+    main()